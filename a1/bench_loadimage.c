@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "knn.h"
+
+/* Microbenchmark for load_image(). Loads every image named in a list file
+ * with the original fscanf-based loader and with load_image(), checks that
+ * both produce the same pixels and prints the images/sec of each.
+ *
+ *    make bench_loadimage
+ * or
+ *    ./bench_loadimage lists/training_full.txt
+ */
+
+#define BENCH_MAX_IMAGES 70000
+
+/* The fscanf-based loader load_image() replaced, kept as the baseline. */
+static void load_image_fscanf(char *filename, unsigned char *img) {
+    FILE *f2 = fopen(filename, "r");
+    if (f2 == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+
+    int columns, rows;
+    fscanf(f2, "P2 %d %d 255", &columns, &rows);
+
+    unsigned char pixel;
+    int index = 0;
+    while (fscanf(f2, "%hhu", &pixel) == 1) {
+        img[index] = pixel;
+        index++;
+    }
+
+    fclose(f2);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char names[BENCH_MAX_IMAGES][MAX_NAME];
+static unsigned char before[NUM_PIXELS];
+static unsigned char after[NUM_PIXELS];
+
+/* Load every image with loader and return the elapsed seconds. */
+static double time_loader(void (*loader)(char *, unsigned char *), int n,
+                          unsigned char *img) {
+    double start = now();
+    for (int i = 0; i < n; i++) {
+        loader(names[i], img);
+    }
+    return now() - start;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s image_list\n", argv[0]);
+        exit(1);
+    }
+
+    FILE *f = fopen(argv[1], "r");
+    if (f == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    int n = 0;
+    while (n < BENCH_MAX_IMAGES && fscanf(f, "%127s", names[n]) == 1) {
+        n++;
+    }
+    fclose(f);
+
+    for (int i = 0; i < n; i++) {
+        load_image_fscanf(names[i], before);
+        load_image(names[i], after);
+        for (int j = 0; j < NUM_PIXELS; j++) {
+            if (before[j] != after[j]) {
+                fprintf(stderr, "%s: pixel %d differs (%d vs %d)\n",
+                        names[i], j, before[j], after[j]);
+                exit(1);
+            }
+        }
+    }
+
+    // The check above also warmed the page cache for both runs
+    double t_before = time_loader(load_image_fscanf, n, before);
+    double t_after = time_loader(load_image, n, after);
+
+    printf("%d images\n", n);
+    printf("fscanf load_image: %10.0f images/sec\n", n / t_before);
+    printf("bulk load_image:   %10.0f images/sec (%.1fx)\n",
+           n / t_after, t_before / t_after);
+    return 0;
+}
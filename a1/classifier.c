@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "knn.h"
 
 /**
@@ -16,6 +17,19 @@
  *
  * Running full evaluation with all images, K = 7: (Will take a while)
  *    ./classifier 7 lists/training_full.txt lists/testing_full.txt
+ *
+ * Same, but compiling each list into a packed binary cache on the first run
+ * (lists/training_full.txt.cache) so that later runs start immediately:
+ *    ./classifier -c 7 lists/training_full.txt lists/testing_full.txt
+ *
+ * Same, spreading the test images over 8 threads:
+ *    ./classifier -c -t 8 7 lists/training_full.txt lists/testing_full.txt
+ *
+ * Same, computing the distances in batches with the GEMM engine:
+ *    ./classifier -c -b -t 8 7 lists/training_full.txt lists/testing_full.txt
+ *
+ * Scoring every K from 1 to 15 with a single scan of the training set:
+ *    ./classifier -c 1..15 lists/training_1k.txt lists/testing_1k.txt
  */
 
 /*****************************************************************************/
@@ -24,8 +38,15 @@
 /*****************************************************************************/
 
 /**
- * main() takes in 3 command line arguments:
- *    - K : The K value for K nearest neighbours
+ * main() takes in 3 command line arguments, optionally preceded by:
+ *    - -c : Load the datasets through their packed binary caches
+ *    - -t <threads> : Number of threads to test images with (default 1)
+ *    - -b : Compute the distances in batches with the GEMM engine (gemm.h)
+ *    - -v : Print the average number of pixels the scan visited per
+ *           training image to stderr
+ *
+ *    - K : The K value for K nearest neighbours, or a range lo..hi to
+ *          report the result for every K in it
  *    - training_list: Name of a file with paths to a set of training images
  *    - testing_list:  Name of a file with paths to a set of testing images
  *
@@ -36,73 +57,99 @@
  *      (Do not print any other output)
  */
 
-/* To store the data from the training and test datasets, we are using a 
- * series of arrays.  Generally speaking, this is a poor design decision
- * because global variables like this are frowned upon, because we are 
- * allocating more memory than necessary, and the code would be more 
- * readable if we could collect data that belonged together into objects
- * (structs).  It is also inflexible, because we cannot handle different 
- * image sizes.
- * 
- * However, we are using this approach because we have not yet covered
- * structs or dynamic memory allocation.
- */
-
-/* training_dataset - a 2D array where each row contains the pixels for a 
- *                    training image
- * training_labels - an array that contains the labels for each image in
- *                   training_data set indicating which digit the image
- *                   represents
- * test_dataset - a 2D array where each row contains the pixels for an image
- *                that we want to classify
- * test_labels - an array containing the labels for the test images so we
- *               can tell whether the prediction was correct
- */
-unsigned char training_dataset[MAX_SIZE][NUM_PIXELS];
-unsigned char training_labels[MAX_SIZE];
-unsigned char test_dataset[MAX_SIZE][NUM_PIXELS];
-unsigned char test_labels[MAX_SIZE];
-
-
 int main(int argc, char *argv[]) {  
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s K training_list test_images\n", argv[0]);
+    int opt;
+    int use_cache = 0;
+    int num_threads = 1;
+    int batched = 0;
+    int verbose = 0;
+    while ((opt = getopt(argc, argv, "bct:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'b':
+            batched = 1;
+            break;
+        case 'c':
+            use_cache = 1;
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b] [-c] [-v] [-t threads] K training_list test_images\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (argc - optind != 3 || num_threads < 1) {
+        fprintf(stderr, "Usage: %s [-b] [-c] [-v] [-t threads] K training_list test_images\n", argv[0]);
+        exit(1);
+    }
+    char *training_file_list = argv[optind + 1];
+    char *test_file_list = argv[optind + 2];
+    int k_min, k_max;
+    if (parse_k_range(argv[optind], &k_min, &k_max) != 0) {
+        fprintf(stderr, "K must be a number or a range lo..hi of at most %d values\n",
+                MAX_K_RANGE);
         exit(1);
     }
-    char *training_file_list = argv[2];
-    char *test_file_list = argv[3];
-    int K = strtod(argv[1], NULL);
 
-    int num_training_files = 0;
-    int num_test_files = 0;
-    int num_correct = 0;
+    Dataset *training;
+    Dataset *testing;
 
     printf("Loading training data...\n");
 
-    num_training_files = load_dataset(training_file_list, training_dataset, training_labels);
+    if (use_cache) {
+        training = load_dataset_cached(training_file_list);
+    } else {
+        training = load_dataset(training_file_list);
+    }
 
     printf("Loading testing data...\n");
 
-    num_test_files = load_dataset(test_file_list, test_dataset, test_labels);
+    if (use_cache) {
+        testing = load_dataset_cached(test_file_list);
+    } else {
+        testing = load_dataset(test_file_list);
+    }
+
+    if (k_min < 1 || k_max > training->num_items) {
+        fprintf(stderr, "K must be between 1 and the number of training images (%d)\n",
+                training->num_items);
+        exit(1);
+    }
 
     /* for each image in the test image dataset, call knn_predict
      * to make a prediction for what digit is represented.  If the
      * prediction matches the test image label, then increment the number
-     * of correct predictions.
+     * of correct predictions. (knn_count_correct() does this over
+     * num_threads threads.)
      */
 
-    int knn_predict_value;
-    int i;
-    for (i = 0; i < num_test_files; i++){
-        knn_predict_value = knn_predict(test_dataset[i], K, training_dataset, training_labels, num_training_files);
-        if (knn_predict_value == test_labels[i]){
-            num_correct++;
-        }
+    int num_correct[k_max - k_min + 1];
+    KnnStats stats = {0, 0};
+    knn_count_correct(training, testing, k_min, k_max, num_threads, batched,
+                      num_correct, &stats);
+    if (verbose && stats.candidates > 0) {
+        fprintf(stderr, "Pixels visited per training image: %.1f of %d\n",
+                (double)stats.pixels / stats.candidates, NUM_PIXELS);
     }
 
     // Print out answer
-    printf("Number of correct predictions: %d\n", num_correct);
-    printf("Accuracy: %.2f%%\n", 100.0*(double)num_correct/num_test_files);
+    if (k_min == k_max) {
+        printf("Number of correct predictions: %d\n", num_correct[0]);
+        printf("Accuracy: %.2f%%\n", 100.0*(double)num_correct[0]/testing->num_items);
+    } else {
+        for (int K = k_min; K <= k_max; K++) {
+            printf("K = %d: Number of correct predictions: %d, Accuracy: %.2f%%\n",
+                   K, num_correct[K - k_min],
+                   100.0*(double)num_correct[K - k_min]/testing->num_items);
+        }
+    }
 
+    free_dataset(training);
+    free_dataset(testing);
     return 0;
 }
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <immintrin.h>
+#include "gemm.h"
+#include "ssd.h"
+
+/**
+ * Return the squared norm of the vector of n unsigned chars a.
+ */
+unsigned int sqnorm_u8(const unsigned char *a, int n) {
+    unsigned int sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * a[i];
+    }
+    return sum;
+}
+
+/* Compute the GEMM_MR x GEMM_NR dot products between the packed queries
+ * q (GEMM_MR rows of stride np int16s) and the training rows t (n bytes
+ * each) into dots, row-major.
+ */
+static void kernel_scalar(const int16_t *q, int np, const unsigned char *const *t,
+                          int n, int *dots) {
+    for (int i = 0; i < GEMM_MR; i++) {
+        for (int j = 0; j < GEMM_NR; j++) {
+            int sum = 0;
+            for (int k = 0; k < n; k++) {
+                sum += q[i * np + k] * t[j][k];
+            }
+            dots[i * GEMM_NR + j] = sum;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static int hsum_avx2(__m256i v) {
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+/* The AVX2 version keeps all 12 dot products in registers. Each step
+ * widens 16 pixels of the 3 training rows to 16 bits once and uses them
+ * against the 4 queries (already widened when they were packed); madd
+ * multiplies and adds adjacent pairs into 32-bit lanes.
+ */
+__attribute__((target("avx2")))
+static void kernel_avx2(const int16_t *q, int np, const unsigned char *const *t,
+                        int n, int *dots) {
+    __m256i c00 = _mm256_setzero_si256(), c01 = c00, c02 = c00;
+    __m256i c10 = c00, c11 = c00, c12 = c00;
+    __m256i c20 = c00, c21 = c00, c22 = c00;
+    __m256i c30 = c00, c31 = c00, c32 = c00;
+    const int16_t *q0 = q, *q1 = q + np, *q2 = q + 2 * np, *q3 = q + 3 * np;
+
+    int k = 0;
+    for (; k + 16 <= n; k += 16) {
+        __m256i t0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(t[0] + k)));
+        __m256i t1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(t[1] + k)));
+        __m256i t2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(t[2] + k)));
+        __m256i a = _mm256_load_si256((const __m256i *)(q0 + k));
+        c00 = _mm256_add_epi32(c00, _mm256_madd_epi16(a, t0));
+        c01 = _mm256_add_epi32(c01, _mm256_madd_epi16(a, t1));
+        c02 = _mm256_add_epi32(c02, _mm256_madd_epi16(a, t2));
+        a = _mm256_load_si256((const __m256i *)(q1 + k));
+        c10 = _mm256_add_epi32(c10, _mm256_madd_epi16(a, t0));
+        c11 = _mm256_add_epi32(c11, _mm256_madd_epi16(a, t1));
+        c12 = _mm256_add_epi32(c12, _mm256_madd_epi16(a, t2));
+        a = _mm256_load_si256((const __m256i *)(q2 + k));
+        c20 = _mm256_add_epi32(c20, _mm256_madd_epi16(a, t0));
+        c21 = _mm256_add_epi32(c21, _mm256_madd_epi16(a, t1));
+        c22 = _mm256_add_epi32(c22, _mm256_madd_epi16(a, t2));
+        a = _mm256_load_si256((const __m256i *)(q3 + k));
+        c30 = _mm256_add_epi32(c30, _mm256_madd_epi16(a, t0));
+        c31 = _mm256_add_epi32(c31, _mm256_madd_epi16(a, t1));
+        c32 = _mm256_add_epi32(c32, _mm256_madd_epi16(a, t2));
+    }
+
+    dots[0] = hsum_avx2(c00); dots[1] = hsum_avx2(c01); dots[2] = hsum_avx2(c02);
+    dots[3] = hsum_avx2(c10); dots[4] = hsum_avx2(c11); dots[5] = hsum_avx2(c12);
+    dots[6] = hsum_avx2(c20); dots[7] = hsum_avx2(c21); dots[8] = hsum_avx2(c22);
+    dots[9] = hsum_avx2(c30); dots[10] = hsum_avx2(c31); dots[11] = hsum_avx2(c32);
+
+    for (; k < n; k++) {
+        for (int i = 0; i < GEMM_MR; i++) {
+            for (int j = 0; j < GEMM_NR; j++) {
+                dots[i * GEMM_NR + j] += q[i * np + k] * t[j][k];
+            }
+        }
+    }
+}
+
+/**
+ * For each of the num_queries images in queries, push every one of the
+ * num_train images in train (whose squared norms are train_norms) to
+ * results[i], with the distance given by metric. All images have n pixels.
+ * Each query's candidates are pushed in increasing index order, so the
+ * results are the same as pushing them one at a time in a loop.
+ *
+ * The AVX2 kernel is used when ssd_kernel() is "avx2", so ssd_select()
+ * also picks the implementation used here.
+ */
+void gemm_knn(const unsigned char *const *queries, int num_queries,
+              const unsigned char *const *train, const unsigned int *train_norms,
+              int num_train, int n, GemmMetric metric, TopKRange *results) {
+    void (*kernel)(const int16_t *, int, const unsigned char *const *, int, int *) =
+        strcmp(ssd_kernel(), "avx2") == 0 ? kernel_avx2 : kernel_scalar;
+
+    // Queries are packed as rows of np int16s, padded with zeros to a
+    // multiple of 16 pixels (one AVX2 register) and 32-byte aligned.
+    int np = (n + 15) / 16 * 16;
+    int16_t *packed;
+    if (posix_memalign((void **)&packed, 32, sizeof(int16_t) * np * GEMM_QUERY_BLOCK) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    unsigned int query_norms[GEMM_QUERY_BLOCK];
+    int dots[GEMM_MR * GEMM_NR];
+
+    for (int q0 = 0; q0 < num_queries; q0 += GEMM_QUERY_BLOCK) {
+        int nq = num_queries - q0 < GEMM_QUERY_BLOCK ? num_queries - q0 : GEMM_QUERY_BLOCK;
+
+        // Pack the block, zero-filling the rows of the last partial tile
+        int nq_padded = (nq + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+        memset(packed, 0, sizeof(int16_t) * np * nq_padded);
+        for (int i = 0; i < nq; i++) {
+            for (int k = 0; k < n; k++) {
+                packed[i * np + k] = queries[q0 + i][k];
+            }
+            query_norms[i] = sqnorm_u8(queries[q0 + i], n);
+        }
+
+        for (int t0 = 0; t0 < num_train; t0 += GEMM_TRAIN_BLOCK) {
+            int nt = num_train - t0 < GEMM_TRAIN_BLOCK ? num_train - t0 : GEMM_TRAIN_BLOCK;
+
+            for (int qi = 0; qi < nq; qi += GEMM_MR) {
+                for (int tj = 0; tj < nt; tj += GEMM_NR) {
+                    // A partial last tile repeats the last row and ignores it
+                    const unsigned char *rows[GEMM_NR];
+                    for (int j = 0; j < GEMM_NR; j++) {
+                        rows[j] = train[t0 + (tj + j < nt ? tj + j : nt - 1)];
+                    }
+                    kernel(packed + qi * np, np, rows, n, dots);
+
+                    for (int i = 0; i < GEMM_MR && qi + i < nq; i++) {
+                        unsigned int qn = query_norms[qi + i];
+                        TopKRange *range = &results[q0 + qi + i];
+                        for (int j = 0; j < GEMM_NR && tj + j < nt; j++) {
+                            int idx = t0 + tj + j;
+                            int dot = dots[i * GEMM_NR + j];
+                            double dist;
+                            if (metric == GEMM_EUCLIDEAN_SQUARED) {
+                                dist = qn + train_norms[idx] - 2 * (unsigned int)dot;
+                            } else {
+                                // Same expression as distance_cosine(a=train, b=query)
+                                double a_root = sqrt(train_norms[idx]);
+                                double b_root = sqrt(qn);
+                                dist = (2 / M_PI) * acos((double)dot / (a_root * b_root));
+                            }
+                            topk_range_push(range, dist, idx);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    free(packed);
+}
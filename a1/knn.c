@@ -2,10 +2,18 @@
 #include <math.h>    // Need this for sqrt()
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "knn.h"
-
-int k_global; // need for find_max function
+#include "ssd.h"
+#include "topk.h"
+#include "gemm.h"
 
 /* Print the image to standard output in the pgmformat.  
  * (Use diff -w to compare the printed output to the original image)
@@ -37,105 +45,446 @@ unsigned char get_label(char *filename) {
  * ******************************************************************/
 
 
-/* Read a pgm image from filename, storing its pixels
- * in the array img.
- * It is recommended to use fscanf to read the values from the file. First, 
- * consume the header information.  You should declare two temporary variables
- * to hold the width and height fields. This allows you to use the format string
- * "P2 %d %d 255 "
- * 
- * To read in each pixel value, use the format string "%hhu " which will store
- * the number it reads in an an unsigned character.
+/* Large enough for a WIDTH x HEIGHT P2 image with 3-digit pixels, generous
+ * whitespace and a few comment lines.
+ */
+#define PGM_BUF_SIZE 16384
+
+/* load_image() reads each file into this buffer, so loading allocates
+ * nothing. It also means load_image() must not run on two threads at once.
+ */
+static unsigned char pgm_buf[PGM_BUF_SIZE];
+
+static void pgm_error(char *filename, char *msg) {
+    fprintf(stderr, "%s: %s\n", filename, msg);
+    exit(1);
+}
+
+/* Skip whitespace and '#' comments, as allowed between PGM header fields. */
+static unsigned char *pgm_skip_space(unsigned char *p, unsigned char *end) {
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n') {
+                p++;
+            }
+        } else if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            p++;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+/* Parse an unsigned decimal number at *p into *value. Return 0 if there is
+ * no number at *p or it is larger than max.
+ */
+static int pgm_number(unsigned char **p, unsigned char *end, int max, int *value) {
+    unsigned char *q = *p;
+    int n = 0;
+    while (q < end && *q >= '0' && *q <= '9') {
+        n = n * 10 + (*q - '0');
+        if (n > max) {
+            return 0;
+        }
+        q++;
+    }
+    if (q == *p) {
+        return 0;
+    }
+    *p = q;
+    *value = n;
+    return 1;
+}
+
+/* Read a pgm image from filename, storing its pixels in the array img.
+ * Both the ASCII (P2) and binary (P5) formats are accepted. The file is
+ * read with a single read() in the common case and parsed in place.
+ * The image must be WIDTH x HEIGHT with a maxval of at most 255; anything
+ * else (or a truncated / oversized body) is reported and exits, so img is
+ * never left partially filled.
  * (Note that the img array is a 1D array of length WIDTH*HEIGHT.)
  */
 void load_image(char *filename, unsigned char *img) {
-    // Open corresponding image file, read in header (which we will discard)
-    FILE *f2 = fopen(filename, "r");
-    if (f2 == NULL) {
-        perror("fopen");
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror(filename);
+        exit(1);
+    }
+
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fd, pgm_buf + len, PGM_BUF_SIZE - len)) > 0) {
+        len += n;
+        if (len == PGM_BUF_SIZE) {
+            pgm_error(filename, "file too large for a PGM image");
+        }
+    }
+    if (n == -1) {
+        perror(filename);
         exit(1);
     }
+    close(fd);
+
+    unsigned char *p = pgm_buf;
+    unsigned char *end = pgm_buf + len;
 
     // parsing header
-    int columns, rows;
-    fscanf(f2, "P2 %d %d 255", &columns, &rows);
+    if (len < 2 || p[0] != 'P' || (p[1] != '2' && p[1] != '5')) {
+        pgm_error(filename, "not a P2 or P5 PGM file");
+    }
+    int binary = p[1] == '5';
+    p += 2;
+
+    int columns, rows, maxval;
+    p = pgm_skip_space(p, end);
+    if (!pgm_number(&p, end, 65535, &columns)) {
+        pgm_error(filename, "bad width in header");
+    }
+    p = pgm_skip_space(p, end);
+    if (!pgm_number(&p, end, 65535, &rows)) {
+        pgm_error(filename, "bad height in header");
+    }
+    p = pgm_skip_space(p, end);
+    if (!pgm_number(&p, end, 255, &maxval) || maxval == 0) {
+        pgm_error(filename, "bad maxval in header");
+    }
+    if (columns != WIDTH || rows != HEIGHT) {
+        pgm_error(filename, "wrong image size");
+    }
+
+    if (binary) {
+        // exactly one whitespace byte separates the header from the pixels
+        if (p == end || (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')) {
+            pgm_error(filename, "bad header terminator");
+        }
+        p++;
+        if (end - p != NUM_PIXELS) {
+            pgm_error(filename, "wrong number of pixels");
+        }
+        memcpy(img, p, NUM_PIXELS);
+        return;
+    }
 
     // going through image body
-    unsigned char pixel;
-    int index = 0;
-    while(fscanf(f2, "%hhu", &pixel) == 1){
+    for (int index = 0; index < NUM_PIXELS; index++) {
+        p = pgm_skip_space(p, end);
+        int pixel;
+        if (!pgm_number(&p, end, maxval, &pixel)) {
+            pgm_error(filename, p == end ? "wrong number of pixels" : "bad pixel value");
+        }
         img[index] = pixel;
-        index++;
     }
+    if (pgm_skip_space(p, end) != end) {
+        pgm_error(filename, "wrong number of pixels");
+    }
+}
+
 
-    fclose(f2);
+/* Bytes reserved for num_items labels at the start of a dataset arena, so
+ * that the pixel rows that follow are DATASET_ALIGN-byte aligned.
+ */
+static size_t labels_size(size_t num_items) {
+    return (num_items + DATASET_ALIGN - 1) / DATASET_ALIGN * DATASET_ALIGN;
 }
 
+/* Allocate a Dataset for num_items images with a single aligned arena
+ * holding the labels followed by the pixel rows.
+ */
+static Dataset *alloc_dataset(int num_items) {
+    Dataset *data = malloc(sizeof(Dataset));
+    if (data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    size_t size = labels_size(num_items) + (size_t)num_items * NUM_PIXELS;
+    if (size == 0) {
+        size = DATASET_ALIGN;
+    }
+    int err = posix_memalign(&data->arena, DATASET_ALIGN, size);
+    if (err != 0) {
+        fprintf(stderr, "posix_memalign: %s\n", strerror(err));
+        exit(1);
+    }
+
+    data->num_items = num_items;
+    data->labels = data->arena;
+    data->pixels = (unsigned char *)data->arena + labels_size(num_items);
+    data->mapped_size = 0;
+    data->norms = NULL;
+    data->block_order = NULL;
+    // keep the padding deterministic, it is written out by write_cache()
+    memset(data->labels + num_items, 0, labels_size(num_items) - num_items);
+    return data;
+}
 
 /**
- * Load a full dataset into a 2D array called dataset.
- *
- * The image files to load are given in filename where
+ * Load a full dataset from the list of image files in filename, where
  * each image file name is on a separate line.
- * 
- * For each image i:
+ *
+ * The list is read twice: once to count the images so that the dataset
+ * can be allocated at its exact size, and once to load them. For each
+ * image i:
  *  - read the pixels into row i (using load_image)
  *  - set the image label in labels[i] (using get_label)
- * 
- * Return number of images read.
+ *
+ * Return the new dataset; free it with free_dataset().
  */
-int load_dataset(char *filename, 
-                 unsigned char dataset[MAX_SIZE][NUM_PIXELS],
-                 unsigned char *labels) {
-    // We expect the file to hold up to MAX_SIZE number of file names
+Dataset *load_dataset(char *filename) {
     FILE *f1 = fopen(filename, "r");
     if (f1 == NULL) {
         perror("fopen");
         exit(1);
     }
 
+    int num_items = 0;
+    char single_filename[MAX_NAME];
+    while(fscanf(f1, "%127s", single_filename) == 1){
+        num_items++;
+    }
+    rewind(f1);
+
+    Dataset *data = alloc_dataset(num_items);
     int index = 0;
-    char single_filename[40];
-    while(fscanf(f1, "%s", single_filename) == 1){
-        labels[index] = get_label(single_filename);
-        load_image(single_filename, dataset[index]);
+    while(index < num_items && fscanf(f1, "%127s", single_filename) == 1){
+        data->labels[index] = get_label(single_filename);
+        load_image(single_filename, dataset_image(data, index));
         index++;
     }
+    if (index != num_items) {
+        fprintf(stderr, "%s changed while it was being read\n", filename);
+        exit(1);
+    }
 
     fclose(f1);
-    return index;
+    return data;
 }
 
-/** 
- * Return the euclidean distance between the image pixels in the image
- * a and b.  (See handout for the euclidean distance function)
+/**
+ * Free a dataset returned by load_dataset() or load_dataset_cached().
  */
-double distance(unsigned char *a, unsigned char *b) {
+void free_dataset(Dataset *data) {
+    if (data == NULL) {
+        return;
+    }
+    if (data->mapped_size != 0) {
+        munmap(data->arena, data->mapped_size);
+    } else {
+        free(data->arena);
+    }
+    free(data->norms);
+    free(data->block_order);
+    free(data);
+}
 
-    int i ;
-    int difference_sum = 0;
-    for (i = 0; i < NUM_PIXELS; i++){
-        int difference_exponent = pow(a[i] - b[i], 2);
+/* Header of the packed binary cache that load_dataset_cached() writes next
+ * to a list file. It is followed by a copy of the dataset's arena: the
+ * labels (padded to DATASET_ALIGN bytes) and then num_items rows of
+ * NUM_PIXELS bytes each. The header is DATASET_ALIGN bytes long, so the
+ * rows stay aligned when the cache is mapped.
+ */
+typedef struct {
+    char magic[8];          // CACHE_MAGIC
+    uint32_t version;       // CACHE_VERSION
+    uint32_t num_items;     // Number of images in the cache
+    uint32_t num_pixels;    // NUM_PIXELS when the cache was written
+    uint32_t reserved;
+    uint64_t list_hash;     // FNV-1a hash of the list file's contents
+    int64_t list_mtime;     // mtime of the list file (ns)
+    int64_t images_mtime;   // newest mtime among the listed images (ns)
+    char pad[16];
+} CacheHeader;
+
+#define CACHE_MAGIC "KNNCACHE"
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".cache"
+
+static int64_t mtime_ns(struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
 
-        difference_sum = difference_sum + difference_exponent;
+/* Fill in the header a valid cache for the list file filename must have
+ * (everything but num_items). Stats every listed image to find the newest
+ * one, which is far cheaper than parsing them.
+ */
+static void cache_expected_header(char *filename, CacheHeader *hdr) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fileno(f), &st) == -1) {
+        perror("fstat");
+        exit(1);
     }
 
-    return sqrt(difference_sum);
+    memset(hdr, 0, sizeof(CacheHeader));
+    memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->version = CACHE_VERSION;
+    hdr->num_pixels = NUM_PIXELS;
+    hdr->list_mtime = mtime_ns(&st);
+
+    uint64_t hash = 14695981039346656037ULL;
+    int c;
+    while ((c = getc(f)) != EOF) {
+        hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+    }
+    hdr->list_hash = hash;
+
+    rewind(f);
+    char name[MAX_NAME];
+    while (fscanf(f, "%127s", name) == 1) {
+        if (stat(name, &st) == -1) {
+            perror(name);
+            exit(1);
+        }
+        if (mtime_ns(&st) > hdr->images_mtime) {
+            hdr->images_mtime = mtime_ns(&st);
+        }
+    }
+    fclose(f);
 }
 
-int find_max(double k_most_similar_set[k_global][2]){
-    int i;
-    int index_largest = 0;
+/* Map the cache in cache_name if it matches expect and return it as a
+ * read-only dataset. Return NULL if the cache is missing or stale.
+ */
+static Dataset *map_cache(char *cache_name, CacheHeader *expect) {
+    int fd = open(cache_name, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
 
-    for(i = 1; i < k_global; i++){
-        if (k_most_similar_set[index_largest][1] < k_most_similar_set[i][1]) {
-            index_largest = i;
-        }
+    CacheHeader hdr;
+    struct stat st;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+        || memcmp(hdr.magic, expect->magic, sizeof(hdr.magic)) != 0
+        || hdr.version != expect->version
+        || hdr.num_pixels != expect->num_pixels
+        || hdr.list_hash != expect->list_hash
+        || hdr.list_mtime != expect->list_mtime
+        || hdr.images_mtime != expect->images_mtime
+        || hdr.num_items > INT_MAX / NUM_PIXELS
+        || fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = sizeof(hdr) + labels_size(hdr.num_items)
+                  + (size_t)hdr.num_items * NUM_PIXELS;
+    if (st.st_size != size) {
+        fprintf(stderr, "%s has the wrong size, rebuilding it\n", cache_name);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    Dataset *data = malloc(sizeof(Dataset));
+    if (data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    data->num_items = hdr.num_items;
+    data->arena = map;
+    data->mapped_size = size;
+    data->labels = (unsigned char *)map + sizeof(hdr);
+    data->pixels = data->labels + labels_size(hdr.num_items);
+    data->norms = NULL;
+    data->block_order = NULL;
+    return data;
+}
+
+/* Write a cache of data to cache_name. The cache is written to a
+ * temporary file first and renamed over cache_name so that a concurrent
+ * reader never sees a partially written file. Failing to write the cache
+ * is not fatal: the next run will just parse the images again.
+ */
+static void write_cache(char *cache_name, CacheHeader *hdr, Dataset *data) {
+    char tmp_name[MAX_NAME + 16];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", cache_name, (int)getpid());
+
+    FILE *f = fopen(tmp_name, "wb");
+    if (f == NULL) {
+        perror(tmp_name);
+        return;
+    }
+
+    size_t arena_size = labels_size(data->num_items)
+                        + (size_t)data->num_items * NUM_PIXELS;
+    int ok = fwrite(hdr, sizeof(CacheHeader), 1, f) == 1
+             && fwrite(data->labels, 1, arena_size, f) == arena_size;
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+
+    if (!ok || rename(tmp_name, cache_name) == -1) {
+        perror(cache_name);
+        unlink(tmp_name);
+    }
+}
+
+/**
+ * Same as load_dataset(), but keeps a packed binary copy of the dataset in
+ * "<filename>.cache". The first call compiles the list into the cache; later
+ * calls map the cache directly as long as the list file's contents and
+ * mtime and the newest mtime among the listed images are unchanged.
+ * The dataset returned from a mapped cache is read-only.
+ */
+Dataset *load_dataset_cached(char *filename) {
+    char cache_name[MAX_NAME];
+    if (snprintf(cache_name, sizeof(cache_name), "%s%s", filename, CACHE_SUFFIX)
+        >= sizeof(cache_name)) {
+        fprintf(stderr, "%s: list name too long to cache\n", filename);
+        return load_dataset(filename);
+    }
+
+    CacheHeader hdr;
+    cache_expected_header(filename, &hdr);
+
+    Dataset *data = map_cache(cache_name, &hdr);
+    if (data != NULL) {
+        return data;
     }
 
-    return index_largest;
+    data = load_dataset(filename);
+    hdr.num_items = data->num_items;
+    write_cache(cache_name, &hdr, data);
+    return data;
+}
+
+/** 
+ * Return the euclidean distance between the image pixels in the image
+ * a and b.  (See handout for the euclidean distance function)
+ * The sum of squares is computed exactly in integers by ssd_u8().
+ */
+double distance(unsigned char *a, unsigned char *b) {
+    return sqrt(ssd_u8(a, b, NUM_PIXELS));
 }
 
+/* Return the most frequent label among the n neighbours in items.
+ * In the case of a tie, return the smallest value digit.
+ */
+static int vote(TopKItem *items, int n, unsigned char *labels) {
+    int frequencies[10] = {0,0,0,0,0,0,0,0,0,0};
+    for (int g = 0; g < n; g++) {
+        frequencies[labels[items[g].idx]]++;
+    }
+
+    int most_frequent_label = 0;
+    for (int g = 1; g < 10; g++) {
+        if (frequencies[most_frequent_label] < frequencies[g]) {
+            most_frequent_label = g;
+        }
+    }
+    return most_frequent_label;
+}
 
 /**
  * Return the most frequent label of the K most similar images to "input"
@@ -144,75 +493,343 @@ int find_max(double k_most_similar_set[k_global][2]){
  *  - input - an array of NUM_PIXELS unsigned chars containing the image to test
  *  - K - an int that determines how many training images are in the 
  *        K-most-similar set
- *  - dataset - a 2D array containing the set of training images.
- *  - labels - the array of labels that correspond to the training dataset
- *  - training_size - the number of images that are actually stored in dataset
+ *  - training - the dataset of training images and their labels
  * 
  * Steps
  *   (1) Find the K images in dataset that have the smallest distance to input
  *         When evaluating an image to decide whether it belongs in the set of 
  *         K closest images, it will only replace an image in the set if its
  *         distance to the test image is strictly less than all of the images in 
- *         the current K closest images.
+ *         the current K closest images. If several images in the set share
+ *         the largest distance, the one in the lowest slot is replaced.
+ *         (See topk.h)
  *   (2) Count the frequencies of the labels in the K images
  *   (3) Return the most frequent label of these K images
  *         In the case of a tie, return the smallest value digit.
  */ 
 
-int knn_predict(unsigned char *input, int K,
-                unsigned char dataset[MAX_SIZE][NUM_PIXELS],
-                unsigned char *labels,
-                int training_size) {
+int knn_predict(unsigned char *input, int K, Dataset *training) {
+    return knn_predict_stats(input, K, training, NULL);
+}
 
-    double k_most_similar_set[K][2]; // type double because item_distance is.
-    int largest_dist_index = 0; // index of item in k_most_similar_set with largest distance.
-    double item_distance; // type double because distance func returns double.
-    k_global = K;
+/**
+ * Same as knn_predict(), and add to *stats (unless it is NULL) how many
+ * candidates were compared and how many pixels that took.
+ */
+int knn_predict_stats(unsigned char *input, int K, Dataset *training,
+                      KnnStats *stats) {
+    int prediction;
+    knn_predict_range(input, K, K, training, &prediction, stats, NULL);
+    return prediction;
+}
 
-    // arbitrarily add first K images
-    int i; // index in training set
-    for (i = 0; i < K; i++){
-        item_distance = distance(input, dataset[i]);
-        k_most_similar_set[i][0] = i;
-        k_most_similar_set[i][1] = item_distance;
+/**
+ * Store in predictions[K - k_min] what knn_predict() would return for
+ * each K from k_min to k_max, with a single scan of training, and add to
+ * *stats (unless it is NULL) how many candidates were compared and how
+ * many pixels that took. storage must have room for
+ * topk_range_items(k_min, k_max) items; if it is NULL, it is allocated for
+ * this call only.
+ *
+ * Once the k_max nearest so far are known, a candidate only matters if it
+ * is strictly closer than the farthest of them, so if knn_prepare() has
+ * been called on training the scan gives up on a candidate as soon as its
+ * partial sum reaches that distance, visiting the pixel blocks with the
+ * highest variance first (ssd_u8_bounded()). This never changes which
+ * neighbours are chosen.
+ */
+void knn_predict_range(unsigned char *input, int k_min, int k_max,
+                       Dataset *training, int *predictions, KnnStats *stats,
+                       TopKItem *storage) {
+    // Neighbours are ranked by squared distance: sqrt() preserves the order
+    // of the exact integer sums, so there is no need to take it.
+    TopKItem *nearest = storage;
+    if (nearest == NULL) {
+        nearest = malloc(sizeof(TopKItem) * topk_range_items(k_min, k_max));
+        if (nearest == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    TopK topks[k_max - k_min + 1];
+    TopKRange range;
+    topk_range_init(&range, topks, nearest, k_min, k_max);
+
+    long long pixels = 0;
+    for (int i = 0; i < training->num_items; i++) {
+        unsigned char *candidate = dataset_image(training, i);
+        if (training->block_order == NULL) {
+            topk_range_push(&range, ssd_u8(input, candidate, NUM_PIXELS), i);
+            pixels += NUM_PIXELS;
+        } else {
+            double bound = topk_range_bound(&range);
+            int visited;
+            unsigned int dist = ssd_u8_bounded(input, candidate, NUM_PIXELS,
+                                               training->block_order,
+                                               bound < UINT_MAX ? bound : UINT_MAX,
+                                               &visited);
+            topk_range_push(&range, dist, i);
+            pixels += visited;
+        }
     }
 
-    // identify index with largest distance
-    largest_dist_index = find_max(k_most_similar_set);
+    if (stats != NULL) {
+        stats->candidates += training->num_items;
+        stats->pixels += pixels;
+    }
+    for (int k = 0; k < range.count; k++) {
+        predictions[k] = vote(topks[k].items, topks[k].size, training->labels);
+    }
+    if (storage == NULL) {
+        free(nearest);
+    }
+}
 
-    for (i = K; i < training_size; i++){
-        item_distance = distance(input, dataset[i]);
-        if (item_distance < k_most_similar_set[largest_dist_index][1]){
-            // replace
-            k_most_similar_set[largest_dist_index][0] = i;
-            k_most_similar_set[largest_dist_index][1] = item_distance;
-            largest_dist_index = find_max(k_most_similar_set);
+/**
+ * Precompute what the kNN scans need about the training set: the squared
+ * norm of every image for knn_predict_batch(), and the order in which
+ * knn_predict() visits pixel blocks. Call this once, before any threads
+ * use training.
+ */
+void knn_prepare(Dataset *training) {
+    if (training->norms != NULL) {
+        return;
+    }
+    training->norms = malloc(sizeof(unsigned int) * (training->num_items + 1));
+    training->block_order = malloc(sizeof(unsigned short) * (NUM_PIXELS / SSD_BLOCK));
+    const unsigned char **rows = malloc(sizeof(unsigned char *) * (training->num_items + 1));
+    if (training->norms == NULL || training->block_order == NULL || rows == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < training->num_items; i++) {
+        rows[i] = dataset_image(training, i);
+        training->norms[i] = sqnorm_u8(rows[i], NUM_PIXELS);
+    }
+    ssd_block_order(rows, training->num_items, NUM_PIXELS, training->block_order);
+    free(rows);
+}
+
+/**
+ * Same as calling knn_predict_range() on each of the n images in inputs,
+ * storing the predictions for image q in predictions[q * (k_max - k_min + 1)]
+ * onwards, but computes the distances for the whole batch at once with
+ * gemm_knn(). knn_prepare() must have been called on training.
+ */
+void knn_predict_batch(unsigned char **inputs, int n, int k_min, int k_max,
+                       Dataset *training, int *predictions) {
+    int count = k_max - k_min + 1;
+    size_t items = topk_range_items(k_min, k_max);
+    TopKItem *storage = malloc(sizeof(TopKItem) * items * n);
+    TopK *topks = malloc(sizeof(TopK) * count * n);
+    TopKRange *ranges = malloc(sizeof(TopKRange) * n);
+    const unsigned char **rows = malloc(sizeof(unsigned char *) * (training->num_items + 1));
+    if (storage == NULL || topks == NULL || ranges == NULL || rows == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < training->num_items; i++) {
+        rows[i] = dataset_image(training, i);
+    }
+    for (int q = 0; q < n; q++) {
+        topk_range_init(&ranges[q], topks + (size_t)q * count,
+                        storage + (size_t)q * items, k_min, k_max);
+    }
+
+    gemm_knn((const unsigned char *const *)inputs, n, rows, training->norms,
+             training->num_items, NUM_PIXELS, GEMM_EUCLIDEAN_SQUARED, ranges);
+
+    for (int q = 0; q < n; q++) {
+        for (int k = 0; k < count; k++) {
+            TopK *topk = &ranges[q].topks[k];
+            predictions[q * count + k] = vote(topk->items, topk->size,
+                                              training->labels);
         }
     }
 
-    // count the frequencies of the labels in the K images
-    int frequencies[10] = {0,0,0,0,0,0,0,0,0,0};
+    free(rows);
+    free(ranges);
+    free(topks);
+    free(storage);
+}
 
-    int g;
-    for(g = 0; g < K; g++){
-        int dataset_index = k_most_similar_set[g][0];
-        int label = labels[dataset_index];
-        frequencies[label] = frequencies[label] + 1;
+/* Number of test images a thread claims at a time. Small enough to keep
+ * the threads busy until the end, large enough that claiming is rare.
+ * The batched engine claims a whole query block at a time.
+ */
+#define EVAL_CHUNK 16
+#define EVAL_BATCH_CHUNK GEMM_QUERY_BLOCK
+
+/* State shared by the threads of knn_count_correct() */
+typedef struct {
+    Dataset *training;
+    Dataset *testing;
+    int k_min;
+    int k_max;
+    int batched;            // 1 to use knn_predict_batch()
+    int next;               // Next test image to claim (atomic)
+} EvalShared;
+
+/* Each thread's view: the shared state and its own counts */
+typedef struct {
+    EvalShared *shared;
+    int *num_correct;       // Correct predictions for each K
+    KnnStats stats;
+    pthread_t tid;
+} EvalWorker;
+
+static void *eval_worker(void *arg) {
+    EvalWorker *worker = arg;
+    EvalShared *shared = worker->shared;
+    Dataset *testing = shared->testing;
+    int count = shared->k_max - shared->k_min + 1;
+
+    int chunk = shared->batched ? EVAL_BATCH_CHUNK : EVAL_CHUNK;
+    unsigned char *inputs[EVAL_BATCH_CHUNK];
+    int *predictions = malloc(sizeof(int) * EVAL_BATCH_CHUNK * count);
+    TopKItem *storage = malloc(sizeof(TopKItem) *
+                               topk_range_items(shared->k_min, shared->k_max));
+    if (predictions == NULL || storage == NULL) {
+        perror("malloc");
+        exit(1);
     }
 
-    // find max frequency
-    int most_frequent_label = 0;
-    for (g = 1; g < 10; g++){
-      if (frequencies[most_frequent_label] < frequencies[g]){
-          most_frequent_label = g;
-      }
-      else if (frequencies[most_frequent_label] == frequencies[g]){
-          // if tie, return smallest value digit
-          if (most_frequent_label > g){
-              most_frequent_label = g;
-          }
-      }
+    for (;;) {
+        int start = __atomic_fetch_add(&shared->next, chunk, __ATOMIC_RELAXED);
+        if (start >= testing->num_items) {
+            break;
+        }
+        int end = start + chunk;
+        if (end > testing->num_items) {
+            end = testing->num_items;
+        }
+
+        if (shared->batched) {
+            for (int i = start; i < end; i++) {
+                inputs[i - start] = dataset_image(testing, i);
+            }
+            knn_predict_batch(inputs, end - start, shared->k_min, shared->k_max,
+                              shared->training, predictions);
+        } else {
+            for (int i = start; i < end; i++) {
+                knn_predict_range(dataset_image(testing, i), shared->k_min,
+                                  shared->k_max, shared->training,
+                                  predictions + (i - start) * count, &worker->stats,
+                                  storage);
+            }
+        }
+
+        for (int i = start; i < end; i++) {
+            for (int k = 0; k < count; k++) {
+                if (predictions[(i - start) * count + k] == testing->labels[i]) {
+                    worker->num_correct[k]++;
+                }
+            }
+        }
     }
+    free(predictions);
+    free(storage);
+    return NULL;
+}
 
-    return most_frequent_label;
+/**
+ * Call knn_predict() for every image in testing, for every K from k_min
+ * to k_max, and store in num_correct[K - k_min] the number of predictions
+ * that match the image's label. Each test image is scanned once for the
+ * whole range (knn_predict_range()).
+ *
+ * The work is spread over num_threads threads which claim EVAL_CHUNK test
+ * images at a time until none are left, so a slow thread does not hold up
+ * the others. Each thread counts its own correct predictions and the
+ * counts are summed at the end, so the result is the same for any number
+ * of threads. With num_threads <= 1 everything runs on the calling thread.
+ * If batched is set, the predictions are made with knn_predict_batch()
+ * instead, which gives the same results. The scan counters of all the
+ * threads are added to *stats unless it is NULL.
+ */
+void knn_count_correct(Dataset *training, Dataset *testing, int k_min, int k_max,
+                       int num_threads, int batched, int *num_correct,
+                       KnnStats *stats) {
+    EvalShared shared = {training, testing, k_min, k_max, batched, 0};
+    int count = k_max - k_min + 1;
+    knn_prepare(training);
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    EvalWorker *workers = malloc(sizeof(EvalWorker) * num_threads);
+    int *counts = calloc((size_t)num_threads * count, sizeof(int));
+    if (workers == NULL || counts == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        workers[t].shared = &shared;
+        workers[t].num_correct = counts + t * count;
+        workers[t].stats.candidates = 0;
+        workers[t].stats.pixels = 0;
+    }
+
+    if (num_threads == 1) {
+        eval_worker(&workers[0]);
+    } else {
+        for (int t = 0; t < num_threads; t++) {
+            int err = pthread_create(&workers[t].tid, NULL, eval_worker, &workers[t]);
+            if (err != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                exit(1);
+            }
+        }
+        for (int t = 0; t < num_threads; t++) {
+            int err = pthread_join(workers[t].tid, NULL);
+            if (err != 0) {
+                fprintf(stderr, "pthread_join: %s\n", strerror(err));
+                exit(1);
+            }
+        }
+    }
+
+    for (int k = 0; k < count; k++) {
+        num_correct[k] = 0;
+    }
+    for (int t = 0; t < num_threads; t++) {
+        for (int k = 0; k < count; k++) {
+            num_correct[k] += workers[t].num_correct[k];
+        }
+        if (stats != NULL) {
+            stats->candidates += workers[t].stats.candidates;
+            stats->pixels += workers[t].stats.pixels;
+        }
+    }
+    free(counts);
+    free(workers);
+}
+
+/**
+ * Parse a K argument, either a single value ("7") or an inclusive range
+ * ("1..15"), into *k_min and *k_max. Return 0 on success and -1 if arg is
+ * not of either form, the range is empty or it holds more than MAX_K_RANGE
+ * values. The values are not otherwise checked.
+ */
+int parse_k_range(const char *arg, int *k_min, int *k_max) {
+    char *end;
+    long lo = strtol(arg, &end, 10);
+    long hi = lo;
+    if (end == arg) {
+        return -1;
+    }
+    if (strncmp(end, "..", 2) == 0) {
+        const char *rest = end + 2;
+        hi = strtol(rest, &end, 10);
+        if (end == rest) {
+            return -1;
+        }
+    }
+    if (*end != '\0' || lo > hi || lo < INT_MIN || hi > INT_MAX || hi - lo >= MAX_K_RANGE) {
+        return -1;
+    }
+    *k_min = lo;
+    *k_max = hi;
+    return 0;
 }
@@ -1,24 +1,21 @@
 #pragma once
 
-/**
- * You should not add anything this file except the value for MAX_SIZE
- * You will not need any other types or data structures other than what
- * has already been defined.
- */
+#include <stddef.h>
+#include "topk.h"
 
 
 #define WIDTH 28  // image width
 #define HEIGHT 28 // image height
-#define NUM_PIXELS WIDTH * HEIGHT
+#define NUM_PIXELS (WIDTH * HEIGHT)
 
-/* The maximum size of a training set or testing set of images
- * The number of images loaded into the training_dataset or test_dataset
- * may be smaller than the maximum, but this allows us to create the global
- * array at compile time.
+/* Most Ks a range given to parse_k_range() may hold: every K of a range
+ * keeps its own neighbours (see topk.h), so the memory and the time per
+ * prediction grow with the square of its width.
  */
-#ifndef MAX_SIZE
-#define MAX_SIZE 60000
-#endif
+#define MAX_K_RANGE 256
+
+/* Alignment of the pixel rows of a Dataset (one cache line) */
+#define DATASET_ALIGN 64
 
 /* You will be reading names of files from the training file list and test 
  * file list.  Use MAX_NAME to declare the array to hold the input.  You can
@@ -26,6 +23,32 @@
  */
 #define MAX_NAME 128
 
+/* This struct stores the images / labels in a dataset. Both live in one
+ * arena sized for exactly num_items images: the labels first, padded to
+ * DATASET_ALIGN bytes, then the rows of pixels back to back, so image i
+ * starts at pixels + i * NUM_PIXELS.
+ */
+typedef struct {
+    int num_items;          // Number of images in the dataset
+    unsigned char *labels;  // Array of `num_items` labels [0-9]
+    unsigned char *pixels;  // `num_items` rows of NUM_PIXELS pixels
+    void *arena;            // Allocation holding labels and pixels
+    size_t mapped_size;     // Non-zero if arena is a mapped cache file
+    unsigned int *norms;    // Squared norm of each image (see knn_prepare)
+    unsigned short *block_order; // Pixel blocks by variance (see knn_prepare)
+} Dataset;
+
+/* Counters for the early-abandon scan in knn_predict_stats() */
+typedef struct {
+    long long candidates;   // Training images compared with a query
+    long long pixels;       // Pixels visited over all those comparisons
+} KnnStats;
+
+/* Return the pixels of image i in data */
+static inline unsigned char *dataset_image(Dataset *data, int i) {
+    return data->pixels + (size_t)i * NUM_PIXELS;
+}
+
 /* These functions are defined in knn.c  Their prototypes are included
  * here so that we don't have to write out the definitions for these
  * functions in the files that use them (e.g. classifier.c)
@@ -34,11 +57,25 @@ void load_image(char *filename, unsigned char *img);
 
 void print_image(unsigned char *img);
 
-int load_dataset(char *filename,
-                 unsigned char dataset[MAX_SIZE][NUM_PIXELS],
-                 unsigned char *labels);
+Dataset *load_dataset(char *filename);
+Dataset *load_dataset_cached(char *filename);
+void free_dataset(Dataset *data);
+
 double distance(unsigned char *a, unsigned char *b);
 
-int knn_predict(unsigned char *input, int K,
-                unsigned char dataset[MAX_SIZE][NUM_PIXELS],
-                unsigned char *labels, int training_size);
+int knn_predict(unsigned char *input, int K, Dataset *training);
+int knn_predict_stats(unsigned char *input, int K, Dataset *training,
+                      KnnStats *stats);
+
+void knn_predict_range(unsigned char *input, int k_min, int k_max,
+                       Dataset *training, int *predictions, KnnStats *stats,
+                       TopKItem *storage);
+
+void knn_prepare(Dataset *training);
+void knn_predict_batch(unsigned char **inputs, int n, int k_min, int k_max,
+                       Dataset *training, int *predictions);
+
+void knn_count_correct(Dataset *training, Dataset *testing, int k_min, int k_max,
+                       int num_threads, int batched, int *num_correct,
+                       KnnStats *stats);
+int parse_k_range(const char *arg, int *k_min, int *k_max);
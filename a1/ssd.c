@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "ssd.h"
+
+static unsigned int ssd_scalar(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned int sum = 0;
+    for (int i = 0; i < n; i++) {
+        int d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+/* Both SIMD kernels widen the bytes to 16 bits, subtract, and let madd
+ * square the differences and add adjacent pairs into 32-bit lanes.
+ */
+__attribute__((target("sse4.1")))
+static unsigned int ssd_sse4(const unsigned char *a, const unsigned char *b, int n) {
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_sub_epi16(_mm_cvtepu8_epi16(va), _mm_cvtepu8_epi16(vb));
+        __m128i hi = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(va, 8)),
+                                   _mm_cvtepu8_epi16(_mm_srli_si128(vb, 8)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (unsigned int)_mm_cvtsi128_si32(acc) + ssd_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int ssd_avx2(const unsigned char *a, const unsigned char *b, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+        __m256i d = _mm256_sub_epi16(va, vb);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (unsigned int)_mm_cvtsi128_si32(sum) + ssd_scalar(a + i, b + i, n - i);
+}
+
+/* The bounded versions visit whole blocks in the given order, check the
+ * bound every SSD_CHECK_BLOCKS blocks and finish with the leftover pixels.
+ */
+static unsigned int ssd_bounded_scalar(const unsigned char *a, const unsigned char *b,
+                                       int n, const unsigned short *order,
+                                       unsigned int bound, int *visited) {
+    int num_blocks = n / SSD_BLOCK;
+    unsigned int sum = 0;
+    for (int i = 0; i < num_blocks; i++) {
+        int offset = order[i] * SSD_BLOCK;
+        sum += ssd_scalar(a + offset, b + offset, SSD_BLOCK);
+        if ((i + 1) % SSD_CHECK_BLOCKS == 0 && sum >= bound) {
+            *visited = (i + 1) * SSD_BLOCK;
+            return sum;
+        }
+    }
+    *visited = n;
+    return sum + ssd_scalar(a + num_blocks * SSD_BLOCK, b + num_blocks * SSD_BLOCK,
+                            n - num_blocks * SSD_BLOCK);
+}
+
+__attribute__((target("sse4.1")))
+static unsigned int ssd_bounded_sse4(const unsigned char *a, const unsigned char *b,
+                                     int n, const unsigned short *order,
+                                     unsigned int bound, int *visited) {
+    int num_blocks = n / SSD_BLOCK;
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < num_blocks; i++) {
+        int offset = order[i] * SSD_BLOCK;
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + offset));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + offset));
+        __m128i lo = _mm_sub_epi16(_mm_cvtepu8_epi16(va), _mm_cvtepu8_epi16(vb));
+        __m128i hi = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(va, 8)),
+                                   _mm_cvtepu8_epi16(_mm_srli_si128(vb, 8)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+        if ((i + 1) % SSD_CHECK_BLOCKS == 0) {
+            __m128i sum = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+            sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+            if ((unsigned int)_mm_cvtsi128_si32(sum) >= bound) {
+                *visited = (i + 1) * SSD_BLOCK;
+                return _mm_cvtsi128_si32(sum);
+            }
+        }
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    *visited = n;
+    return (unsigned int)_mm_cvtsi128_si32(acc)
+           + ssd_scalar(a + num_blocks * SSD_BLOCK, b + num_blocks * SSD_BLOCK,
+                        n - num_blocks * SSD_BLOCK);
+}
+
+__attribute__((target("avx2")))
+static unsigned int ssd_bounded_avx2(const unsigned char *a, const unsigned char *b,
+                                     int n, const unsigned short *order,
+                                     unsigned int bound, int *visited) {
+    int num_blocks = n / SSD_BLOCK;
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < num_blocks; i++) {
+        int offset = order[i] * SSD_BLOCK;
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + offset)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + offset)));
+        __m256i d = _mm256_sub_epi16(va, vb);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+        if ((i + 1) % SSD_CHECK_BLOCKS == 0) {
+            __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                        _mm256_extracti128_si256(acc, 1));
+            sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+            sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+            if ((unsigned int)_mm_cvtsi128_si32(sum) >= bound) {
+                *visited = (i + 1) * SSD_BLOCK;
+                return _mm_cvtsi128_si32(sum);
+            }
+        }
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    *visited = n;
+    return (unsigned int)_mm_cvtsi128_si32(sum)
+           + ssd_scalar(a + num_blocks * SSD_BLOCK, b + num_blocks * SSD_BLOCK,
+                        n - num_blocks * SSD_BLOCK);
+}
+
+typedef struct {
+    const char *name;
+    unsigned int (*fn)(const unsigned char *, const unsigned char *, int);
+    unsigned int (*bounded)(const unsigned char *, const unsigned char *, int,
+                            const unsigned short *, unsigned int, int *);
+    int (*supported)(void);
+} SsdKernel;
+
+static int has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static int has_sse4(void) {
+    return __builtin_cpu_supports("sse4.1");
+}
+
+static int always(void) {
+    return 1;
+}
+
+/* In order of preference */
+static const SsdKernel kernels[] = {
+    {"avx2", ssd_avx2, ssd_bounded_avx2, has_avx2},
+    {"sse4", ssd_sse4, ssd_bounded_sse4, has_sse4},
+    {"scalar", ssd_scalar, ssd_bounded_scalar, always},
+};
+
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static const SsdKernel *current = &kernels[NUM_KERNELS - 1];
+
+/* Runs before main(), so ssd_u8() never has to check whether it has
+ * picked an implementation and can be called from any thread.
+ */
+__attribute__((constructor))
+static void ssd_init(void) {
+    __builtin_cpu_init();
+    for (int i = 0; i < NUM_KERNELS; i++) {
+        if (kernels[i].supported()) {
+            current = &kernels[i];
+            return;
+        }
+    }
+}
+
+unsigned int ssd_u8(const unsigned char *a, const unsigned char *b, int n) {
+    return current->fn(a, b, n);
+}
+
+unsigned int ssd_u8_bounded(const unsigned char *a, const unsigned char *b, int n,
+                            const unsigned short *order, unsigned int bound,
+                            int *visited) {
+    return current->bounded(a, b, n, order, bound, visited);
+}
+
+void ssd_block_order(const unsigned char *const *rows, int num_rows, int n,
+                     unsigned short *order) {
+    int num_blocks = n / SSD_BLOCK;
+    unsigned long long *sums = calloc(2 * (size_t)n + 1, sizeof(unsigned long long));
+    double *variance = calloc(num_blocks + 1, sizeof(double));
+    if (sums == NULL || variance == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // Per-pixel sums and sums of squares, one row at a time
+    unsigned long long *sum_sq = sums + n;
+    for (int r = 0; r < num_rows; r++) {
+        for (int p = 0; p < n; p++) {
+            sums[p] += rows[r][p];
+            sum_sq[p] += rows[r][p] * rows[r][p];
+        }
+    }
+    for (int p = 0; p < num_blocks * SSD_BLOCK && num_rows > 0; p++) {
+        double mean = (double)sums[p] / num_rows;
+        variance[p / SSD_BLOCK] += (double)sum_sq[p] / num_rows - mean * mean;
+    }
+
+    // Insertion sort by decreasing variance; stable, so ties keep index order
+    for (int i = 0; i < num_blocks; i++) {
+        int j = i;
+        while (j > 0 && variance[order[j - 1]] < variance[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    free(variance);
+    free(sums);
+}
+
+const char *ssd_kernel(void) {
+    return current->name;
+}
+
+int ssd_select(const char *name) {
+    for (int i = 0; i < NUM_KERNELS; i++) {
+        if (strcmp(kernels[i].name, name) == 0 && kernels[i].supported()) {
+            current = &kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
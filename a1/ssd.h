@@ -0,0 +1,43 @@
+#pragma once
+
+/* Sum of squared differences (the squared euclidean distance) between two
+ * vectors of n unsigned chars. The result is exact: with n = 784 it is at
+ * most 784 * 255^2, far below UINT_MAX.
+ *
+ * The implementation is picked once at startup from the CPU's features
+ * (AVX2, then SSE4.1, then plain C). All of them return the same values.
+ */
+unsigned int ssd_u8(const unsigned char *a, const unsigned char *b, int n);
+
+/* Pixels are visited in blocks of SSD_BLOCK by ssd_u8_bounded(), which
+ * compares the partial sum with its bound every SSD_CHECK_BLOCKS blocks.
+ */
+#define SSD_BLOCK 16
+#define SSD_CHECK_BLOCKS 4
+
+/* Same as ssd_u8(), but visits the n / SSD_BLOCK blocks of SSD_BLOCK
+ * pixels in the order given by order (block indices, e.g. from
+ * ssd_block_order()), then any pixels left over, and gives up early once
+ * the partial sum reaches bound. The result is the exact sum if it is
+ * below bound, and some value >= bound otherwise. The number of pixels
+ * visited is stored in *visited.
+ */
+unsigned int ssd_u8_bounded(const unsigned char *a, const unsigned char *b, int n,
+                            const unsigned short *order, unsigned int bound,
+                            int *visited);
+
+/* Store in order the n / SSD_BLOCK blocks of the num_rows vectors in rows,
+ * from the highest total pixel variance to the lowest (ties by index).
+ * Visiting high-variance blocks first makes ssd_u8_bounded() reach its
+ * bound sooner for far-away vectors.
+ */
+void ssd_block_order(const unsigned char *const *rows, int num_rows, int n,
+                     unsigned short *order);
+
+/* Name of the implementation ssd_u8() uses: "avx2", "sse4", or "scalar" */
+const char *ssd_kernel(void);
+
+/* Force the implementation called name (as returned by ssd_kernel()).
+ * Return 0 on success, or -1 if it is unknown or the CPU lacks support.
+ */
+int ssd_select(const char *name);
@@ -0,0 +1,115 @@
+#include "topk.h"
+
+/* Return 1 if item a would be replaced before item b: a is farther, or as
+ * far and in a lower slot.
+ */
+static int farther(const TopKItem *a, const TopKItem *b) {
+    return a->dist > b->dist || (a->dist == b->dist && a->slot < b->slot);
+}
+
+static void sift_down(TopKItem *items, int size, int i) {
+    TopKItem item = items[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && farther(&items[child + 1], &items[child])) {
+            child++;
+        }
+        if (!farther(&items[child], &item)) {
+            break;
+        }
+        items[i] = items[child];
+        i = child;
+    }
+    items[i] = item;
+}
+
+/**
+ * Prepare t to select the k nearest candidates, using storage (which must
+ * have room for k items) to hold them.
+ */
+void topk_init(TopK *t, TopKItem *storage, int k) {
+    t->k = k;
+    t->size = 0;
+    t->heap = k > TOPK_SORTED_MAX;
+    t->items = storage;
+}
+
+/**
+ * Add a candidate that topk_push() has already checked is closer than the
+ * current bound. While t is not full the candidate takes the next free
+ * slot; otherwise it replaces topk_worst() and takes over its slot.
+ */
+void topk_insert(TopK *t, double dist, int idx) {
+    TopKItem *items = t->items;
+    TopKItem item = {dist, idx, t->size};
+    if (t->size == t->k) {
+        item.slot = topk_worst(t)->slot;
+    }
+
+    if (!t->heap) {
+        // Shift farther items up one slot, dropping the last one if full
+        int i = t->size < t->k ? t->size++ : t->size - 1;
+        while (i > 0 && farther(&items[i - 1], &item)) {
+            items[i] = items[i - 1];
+            i--;
+        }
+        items[i] = item;
+    } else if (t->size < t->k) {
+        // Sift up from the new leaf
+        int i = t->size++;
+        while (i > 0 && farther(&item, &items[(i - 1) / 2])) {
+            items[i] = items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        items[i] = item;
+    } else {
+        // Replace the root
+        items[0] = item;
+        sift_down(items, t->size, 0);
+    }
+}
+
+/* Order for the final sort: nearest first, ties by training index */
+static int nearer(const TopKItem *a, const TopKItem *b) {
+    return a->dist < b->dist || (a->dist == b->dist && a->idx < b->idx);
+}
+
+/**
+ * Sort the kept items from nearest to farthest (ties by index) in place
+ * and return how many there are. After this t can no longer be pushed to:
+ * call topk_init() to reuse it.
+ */
+int topk_sort(TopK *t) {
+    TopKItem *items = t->items;
+    for (int i = 1; i < t->size; i++) {
+        TopKItem item = items[i];
+        int j = i;
+        while (j > 0 && nearer(&item, &items[j - 1])) {
+            items[j] = items[j - 1];
+            j--;
+        }
+        items[j] = item;
+    }
+    t->k = t->size;
+    t->heap = 0;
+    return t->size;
+}
+
+/**
+ * Prepare r to select the K nearest candidates for every K from k_min to
+ * k_max, with the array topks (k_max - k_min + 1 entries) and storage
+ * (topk_range_items(k_min, k_max) items) to hold them.
+ */
+void topk_range_init(TopKRange *r, TopK *topks, TopKItem *storage,
+                     int k_min, int k_max) {
+    r->k_min = k_min;
+    r->count = k_max - k_min + 1;
+    r->topks = topks;
+    for (int k = k_min; k <= k_max; k++) {
+        topk_init(&topks[k - k_min], storage, k);
+        storage += k;
+    }
+}
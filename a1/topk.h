@@ -0,0 +1,107 @@
+#pragma once
+
+/* Bounded selection of the K nearest neighbours seen so far.
+ *
+ * This keeps the rules of the original kNN loop, which held the K closest
+ * images in an array of K slots: the first K candidates fill the slots in
+ * order, and each later candidate replaces the farthest image in the set
+ * only if it is strictly closer, taking over its slot. When several images
+ * share the largest distance, the one in the lowest slot is replaced.
+ * Since ties are common (the images are mostly 0 and 255), which image is
+ * replaced matters, and the result depends on the order of the pushes:
+ * push candidates in increasing index order to match the original loop.
+ *
+ * All of the state lives in a TopK and the storage the caller gives it,
+ * so any number of selections can run at once on different threads.
+ * Up to TOPK_SORTED_MAX items are kept in a sorted array (a few compares
+ * and moves per insertion); larger K uses a binary max-heap, so each
+ * insertion is O(log K) instead of a rescan of all K slots.
+ */
+
+#include <math.h>
+#include <stddef.h>
+
+#define TOPK_SORTED_MAX 16
+
+/* One candidate neighbour */
+typedef struct {
+    double dist;            // Distance to the query
+    int idx;                // Index of the candidate in the training set
+    int slot;               // Slot the candidate holds in the original loop
+} TopKItem;
+
+typedef struct {
+    int k;                  // Maximum number of items to keep
+    int size;               // Number of items currently kept
+    int heap;               // 1 if items is a max-heap, 0 if sorted
+    TopKItem *items;        // Caller-provided storage for k items
+} TopK;
+
+void topk_init(TopK *t, TopKItem *storage, int k);
+void topk_insert(TopK *t, double dist, int idx);
+int topk_sort(TopK *t);
+
+/* Return the item the next closer candidate would replace, or NULL if
+ * fewer than k items are kept.
+ */
+static inline TopKItem *topk_worst(TopK *t) {
+    if (t->size < t->k) {
+        return NULL;
+    }
+    return t->heap ? &t->items[0] : &t->items[t->size - 1];
+}
+
+/* Return the distance a candidate has to be strictly below to be kept:
+ * the farthest distance kept, or INFINITY while fewer than k are kept.
+ */
+static inline double topk_bound(TopK *t) {
+    TopKItem *worst = topk_worst(t);
+    return worst == NULL ? INFINITY : worst->dist;
+}
+
+/* Offer a candidate. Return 1 if it was kept. Candidates that are not
+ * closer than topk_bound() are rejected here without a function call;
+ * NaN and infinite distances are never kept.
+ */
+static inline int topk_push(TopK *t, double dist, int idx) {
+    if (!(dist < topk_bound(t))) {
+        return 0;
+    }
+    topk_insert(t, dist, idx);
+    return 1;
+}
+
+/* Selections for every K from k_min to k_max over the same candidates, so
+ * that one pass over the training set answers all of them. Each
+ * selection keeps the rules above, so selection K ends up with the same
+ * items as a TopK of its own would.
+ *
+ * The farthest distance kept never decreases with K, so a candidate
+ * rejected for one K is rejected for every smaller K: pushes go from
+ * k_max down and stop at the first selection that rejects the candidate.
+ */
+typedef struct {
+    int k_min;              // K of topks[0]
+    int count;              // Number of selections (k_max - k_min + 1)
+    TopK *topks;            // topks[i] selects the k_min + i nearest
+} TopKRange;
+
+/* Number of TopKItems a TopKRange for k_min..k_max needs */
+static inline size_t topk_range_items(int k_min, int k_max) {
+    return ((size_t)k_min + k_max) * ((size_t)k_max - k_min + 1) / 2;
+}
+
+void topk_range_init(TopKRange *r, TopK *topks, TopKItem *storage,
+                     int k_min, int k_max);
+
+/* The bound of the largest selection: candidates not strictly closer
+ * than this are rejected by every selection.
+ */
+static inline double topk_range_bound(TopKRange *r) {
+    return topk_bound(&r->topks[r->count - 1]);
+}
+
+static inline void topk_range_push(TopKRange *r, double dist, int idx) {
+    for (int i = r->count - 1; i >= 0 && topk_push(&r->topks[i], dist, idx); i--) {
+    }
+}
@@ -0,0 +1,169 @@
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "dectree.h"
+
+/* Benchmark for tree building and classification. Builds the tree from
+ * the training set's pixel bytes, from its pixel-major copy (see
+ * transpose_dataset) and from its packed bits (see pack_dataset), and
+ * prints the time and cache misses of each (the misses are counted like
+ * `perf stat -e cache-misses` does, when the CPU's counters can be read).
+ * Then compiles the tree, checks that dec_tree_classify() and
+ * flat_tree_classify() agree on every test image and prints the
+ * classifications/sec of each (the best of BENCH_REPS passes over the
+ * test set).
+ *
+ *    make bench
+ * or
+ *    ./bench_classify datasets/training_data.bin datasets/testing_data.bin
+ */
+
+#define BENCH_REPS 10
+
+/* Size of the forests built, and pixels tried per split */
+#define FOREST_TREES 10
+#define FOREST_PIXELS 28
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile int sink;
+
+/* Open a counter of this process's cache misses, or return -1 if there is
+ * none (no hardware counters in a VM, or perf_event_paranoid forbids it).
+ */
+static int open_cache_misses(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Build a tree (or a forest of num_trees trees if num_trees > 0) from the
+ * training set in filename, transposed first if columns, packed first if
+ * packed. Store the build time (not counting the load) and cache misses
+ * (-1 if unknown) and return the tree (NULL for a forest).
+ */
+static DTNode *time_build(const char *filename, int columns, int packed, int num_trees,
+                          double *time, long long *misses) {
+    Dataset *training = load_dataset(filename);
+    int fd = open_cache_misses();
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    double start = now();
+    if (columns) {
+        transpose_dataset(training);
+    }
+    if (packed) {
+        pack_dataset(training);
+    }
+    DTNode *root = NULL;
+    if (num_trees > 0) {
+        free_forest(build_forest(training, num_trees, FOREST_PIXELS, 1, NULL));
+    } else {
+        root = build_dec_tree(training);
+    }
+    *time = now() - start;
+
+    *misses = -1;
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, misses, sizeof(*misses)) != sizeof(*misses)) {
+            *misses = -1;
+        }
+        close(fd);
+    }
+    free_dataset(training);
+    return root;
+}
+
+static void print_build(const char *what, const char *from, double time, long long misses) {
+    if (misses >= 0) {
+        printf("%-6s from %-8s %8.3f s %14lld cache misses\n", what, from, time, misses);
+    } else {
+        printf("%-6s from %-8s %8.3f s %14s cache misses\n", what, from, time, "n/a");
+    }
+}
+
+/* Return the best time over BENCH_REPS passes classifying testing with
+ * the pointer tree (flat == NULL) or the compiled one.
+ */
+static double time_classify(DTNode *root, FlatTree *flat, Dataset *testing) {
+    double best = 0;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        int sum = 0;
+        double start = now();
+        for (int i = 0; i < testing->num_items; i++) {
+            if (flat == NULL) {
+                sum += dec_tree_classify(root, &testing->images[i]);
+            } else {
+                sum += flat_tree_classify(flat, &testing->images[i]);
+            }
+        }
+        double elapsed = now() - start;
+        sink = sum;
+        if (r == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s training_data testing_data\n", argv[0]);
+        exit(1);
+    }
+
+    double time;
+    long long misses;
+    DTNode *root = time_build(argv[1], 0, 0, 0, &time, &misses);
+    print_build("tree", "bytes:", time, misses);
+    free_dec_tree(time_build(argv[1], 1, 0, 0, &time, &misses));
+    print_build("tree", "columns:", time, misses);
+    free_dec_tree(time_build(argv[1], 0, 1, 0, &time, &misses));
+    print_build("tree", "packed:", time, misses);
+    time_build(argv[1], 0, 0, FOREST_TREES, &time, &misses);
+    print_build("forest", "bytes:", time, misses);
+    time_build(argv[1], 1, 0, FOREST_TREES, &time, &misses);
+    print_build("forest", "columns:", time, misses);
+
+    Dataset *testing = load_dataset(argv[2]);
+    FlatTree *flat = compile_dec_tree(root);
+
+    for (int i = 0; i < testing->num_items; i++) {
+        int expected = dec_tree_classify(root, &testing->images[i]);
+        int actual = flat_tree_classify(flat, &testing->images[i]);
+        if (expected != actual) {
+            fprintf(stderr, "Test image %d: pointer tree says %d, flat tree says %d\n",
+                    i, expected, actual);
+            exit(1);
+        }
+    }
+
+    double pointer_time = time_classify(root, NULL, testing);
+    double flat_time = time_classify(root, flat, testing);
+    printf("%d nodes (%zu bytes compiled), %d test images\n", flat->num_nodes,
+           flat->num_nodes * sizeof(FlatNode), testing->num_items);
+    printf("pointer tree: %12.0f classifications/sec\n", testing->num_items / pointer_time);
+    printf("flat tree:    %12.0f classifications/sec (%.2fx)\n",
+           testing->num_items / flat_time, pointer_time / flat_time);
+
+    free_flat_tree(flat);
+    free_dec_tree(root);
+    free_dataset(testing);
+    return 0;
+}
@@ -12,6 +12,9 @@
  * Copyright (c) 2021 Karen Reid
  */
 
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
 #include "dectree.h"
 
 // Makefile included in starter:
@@ -20,6 +23,27 @@
 //
 // Running decision tree generation / validation:
 //    ./classifier datasets/training_data.bin datasets/testing_data.bin
+//
+// Same, building the tree from a bit-packed copy of the training images:
+//    ./classifier -p datasets/training_data.bin datasets/testing_data.bin
+//
+// Same, building the tree from a pixel-major copy of the training images:
+//    ./classifier -c datasets/training_data.bin datasets/testing_data.bin
+//
+// Same, building the tree with 8 threads:
+//    ./classifier -p -t 8 datasets/training_data.bin datasets/testing_data.bin
+//
+// Random forest of 50 trees, each split picked among 28 random pixels:
+//    ./classifier -t 8 -f 50 -m 28 datasets/training_data.bin datasets/testing_data.bin
+//
+// Classifying images as they arrive on stdin (records without the header
+// of a dataset file), printing each predicted label as soon as it is known:
+//    tail -c +5 datasets/testing_data.bin | ./classifier --load-model tree.model --stream -
+//
+// Same, also saving the compiled tree, then classifying with the saved
+// tree without training again:
+//    ./classifier --save-model tree.model datasets/training_data.bin datasets/testing_data.bin
+//    ./classifier --load-model tree.model datasets/testing_data.bin
 
 /*****************************************************************************/
 /* Do not add anything outside the main function here. Any core logic other  */
@@ -27,15 +51,31 @@
 /*****************************************************************************/
 
 /**
- * main() takes in 2 command line arguments:
+ * main() takes in 2 command line arguments, optionally preceded by:
+ *    - -p : Build the tree from bit-packed images (see pack_dataset)
+ *    - -c : Build the tree from pixel-major images (see transpose_dataset)
+ *    - -t <threads> : Number of threads to build the tree with (default 1)
+ *    - -f <trees> : Build a random forest of that many trees (see build_forest)
+ *    - -m <pixels> : Pixels tried per split in a forest (default 28)
+ *    - -s <seed> : Seed of the forest's random choices (default 1)
+ *    - --save-model <file> : Save the compiled tree(s) to file (see save_model)
+ *    - --load-model <file> : Classify with the model in file instead of
+ *          building a tree; training_data is then left out
+ *    - --stream : Read testing_data ("-" for stdin, or a FIFO) as a stream of
+ *          records as they arrive and print one predicted label per line
+ *          (see classify_stream) instead of the number of correct ones
+ *    - --unlabeled : (With --stream) The records are only the pixels
+ *
  *    - training_data: A binary file containing training image / label data
  *    - testing_data: A binary file containing testing image / label data
  *
  * You need to do the following:
  *    - Parse the command line arguments, call `load_dataset()` appropriately.
  *    - Call `make_dec_tree()` to build the decision tree with training data
- *    - For each test image, call `dec_tree_classify()` and compare the real 
- *        label with the predicted label
+ *    - For each test image, call `dec_tree_classify()` (or `flat_tree_classify()`
+ *        on the compiled tree, which gives the same label) and compare the real 
+ *        label with the predicted label. A forest votes on the labels of all
+ *        the test images with `forest_classify_batch()`.
  *    - Print out (only) one integer to stdout representing the number of 
  *        test images that were correctly classified.
  *    - Free all the data dynamically allocated and exit.
@@ -43,37 +83,181 @@
  */
 int main(int argc, char *argv[]) {
     int total_correct = 0;
+    int packed = 0;
+    int columns = 0;
+    int num_threads = 1;
+    int num_trees = 0;
+    int num_candidates = 28;
+    unsigned long long seed = 1;
+    char* save_file = NULL;
+    char* load_file = NULL;
+    int stream = 0;
+    int labeled = 1;
+    int opt;
+
+    static struct option long_options[] = {
+        {"save-model", required_argument, NULL, 'S'},
+        {"load-model", required_argument, NULL, 'L'},
+        {"stream", no_argument, NULL, 'T'},
+        {"unlabeled", no_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s training_data testing_data\n", argv[0]);
+    while ((opt = getopt_long(argc, argv, "pct:f:m:s:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            packed = 1;
+            break;
+        case 'c':
+            columns = 1;
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'f':
+            num_trees = atoi(optarg);
+            break;
+        case 'm':
+            num_candidates = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'S':
+            save_file = optarg;
+            break;
+        case 'L':
+            load_file = optarg;
+            break;
+        case 'T':
+            stream = 1;
+            break;
+        case 'U':
+            labeled = 0;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p] [-c] [-t threads] [-f trees [-m pixels] [-s seed]]\n"
+                            "          [--save-model file] [--stream [--unlabeled]] training_data testing_data\n"
+                            "       %s --load-model file [--stream [--unlabeled]] testing_data\n",
+                    argv[0], argv[0]);
+            exit(1);
+        }
+    }
+
+    int num_args = load_file != NULL ? 1 : 2;
+    if (argc - optind != num_args || num_threads < 1 || num_trees < 0 || num_candidates < 1
+        || (load_file != NULL && save_file != NULL)) {
+        fprintf(stderr, "Usage: %s [-p] [-c] [-t threads] [-f trees [-m pixels] [-s seed]]\n"
+                        "          [--save-model file] [--stream [--unlabeled]] training_data testing_data\n"
+                        "       %s --load-model file [--stream [--unlabeled]] testing_data\n",
+                argv[0], argv[0]);
         exit(1);
     }
 
-    char* binary_train = argv[1];
-    char* binary_test = argv[2];
+    Dataset* training_dataset_ptr = NULL;
+    DTNode* dec_tree_ptr = NULL;
+    FlatTree* flat_tree_ptr = NULL;
+    Forest* forest_ptr = NULL;
+    Model* model_ptr = NULL;
+    FlatTree* trees;        // The compiled tree(s) to classify with
+    int trees_count;
+
+    if (load_file != NULL) {
+        // The model is used straight from the page cache, no training
+        model_ptr = load_model(load_file);
+        if (model_ptr == NULL) {
+            exit(1);
+        }
+        trees = (*model_ptr).trees;
+        trees_count = (*model_ptr).num_trees;
+    }
+    else {
+        training_dataset_ptr = load_dataset(argv[optind]);
+        if (packed) {
+            pack_dataset(training_dataset_ptr);
+        }
+        if (columns) {
+            transpose_dataset(training_dataset_ptr);
+        }
 
-    Dataset* training_dataset_ptr = load_dataset(binary_train);
-    Dataset* testing_dataset_ptr = load_dataset(binary_test);
+        Pool *pool = num_threads > 1 ? pool_create(num_threads) : NULL;
+        if (num_trees > 0) {
+            forest_ptr = build_forest(training_dataset_ptr, num_trees, num_candidates, seed, pool);
+            trees = (*forest_ptr).trees;
+            trees_count = (*forest_ptr).num_trees;
+        }
+        else {
+            dec_tree_ptr = build_dec_tree_parallel(training_dataset_ptr, pool);
+            // Classify with the compiled form of the tree (same results, faster)
+            flat_tree_ptr = compile_dec_tree(dec_tree_ptr);
+            trees = flat_tree_ptr;
+            trees_count = 1;
+        }
+        pool_destroy(pool);
 
-    DTNode* dec_tree_ptr = build_dec_tree(training_dataset_ptr);
+        if (save_file != NULL && save_model(save_file, trees, trees_count) != 0) {
+            exit(1);
+        }
+    }
 
-    int num_test_images = (*testing_dataset_ptr).num_items;
-    for (int i = 0; i < num_test_images; i++){
-        Image curr_image = (*testing_dataset_ptr).images[i];
-        int real_label = (*testing_dataset_ptr).labels[i];
-        int predicted_label = dec_tree_classify(dec_tree_ptr, &curr_image);
-        if (real_label == predicted_label){
-            total_correct++;
+    if (stream) {
+        char* stream_file = argv[argc - 1];
+        int fd = strcmp(stream_file, "-") == 0 ? STDIN_FILENO : open(stream_file, O_RDONLY);
+        if (fd == -1) {
+            perror(stream_file);
+            exit(1);
+        }
+        int stream_correct;
+        int stream_total = classify_stream(trees, trees_count, fd, labeled, stdout,
+                                           &stream_correct);
+        if (labeled) {
+            fprintf(stderr, "%d of %d correct\n", stream_correct, stream_total);
+        }
+        if (fd != STDIN_FILENO) {
+            close(fd);
         }
     }
+    else {
+        Dataset* testing_dataset_ptr = load_dataset(argv[argc - 1]);
 
-    // Print out answer
-    printf("%d\n", total_correct);
+        int num_test_images = (*testing_dataset_ptr).num_items;
+        int* predicted_labels = malloc(sizeof(int) * num_test_images);
+        if (predicted_labels == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (trees_count == 1) {
+            for (int i = 0; i < num_test_images; i++){
+                predicted_labels[i] = flat_tree_classify(trees, &(*testing_dataset_ptr).images[i]);
+            }
+        }
+        else {
+            forest_classify_batch(trees, trees_count, (*testing_dataset_ptr).images,
+                                  num_test_images, predicted_labels);
+        }
+        for (int i = 0; i < num_test_images; i++){
+            int real_label = (*testing_dataset_ptr).labels[i];
+            if (real_label == predicted_labels[i]){
+                total_correct++;
+            }
+        }
+        free(predicted_labels);
+
+        // Print out answer
+        printf("%d\n", total_correct);
+        free_dataset(testing_dataset_ptr);
+    }
 
     // Free all dynamically allocated data
-    free_dataset(training_dataset_ptr);
-    free_dataset(testing_dataset_ptr);
-    free_dec_tree(dec_tree_ptr);
+    if (training_dataset_ptr != NULL) {
+        free_dataset(training_dataset_ptr);
+    }
+    if (dec_tree_ptr != NULL) {
+        free_dec_tree(dec_tree_ptr);
+        free_flat_tree(flat_tree_ptr);
+    }
+    free_forest(forest_ptr);
+    free_model(model_ptr);
 
     return 0;
 }
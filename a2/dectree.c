@@ -12,8 +12,29 @@
  * Copyright (c) 2021 Karen Reid
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "dectree.h"
 
+/* Bytes per image in a dataset file: the label, then the pixels */
+#define RECORD_SIZE (1 + NUM_PIXELS)
+
+/* Images read from a dataset file at a time */
+#define LOAD_CHUNK 4096
+
+/* Report why a fread() from f (opened from filename) came up short, and exit */
+static void read_failed(FILE *f, const char *filename) {
+    if (ferror(f)) {
+        perror(filename);
+    } else {
+        fprintf(stderr, "%s: truncated file\n", filename);
+    }
+    exit(1);
+}
+
 /**
  * Load the binary file, filename into a Dataset and return a pointer to 
  * the Dataset. The binary file format is as follows:
@@ -27,6 +48,10 @@
  *
  * You can set the `sx` and `sy` values for all the images to WIDTH. 
  * Use the NUM_PIXELS and WIDTH constants defined in dectree.h
+ *
+ * N must match the size of the file. The records are read LOAD_CHUNK at a
+ * time, and the pixels of all the images go into one block (`pixels`)
+ * that the images' data point into.
  */
 Dataset *load_dataset(const char *filename) {
     // TODO: Allocate data, read image data / labels, return
@@ -39,45 +64,138 @@ Dataset *load_dataset(const char *filename) {
 
     Dataset* dataset = malloc(sizeof(Dataset));
     int num_files;
-    fread(&num_files, sizeof(int), 1, f1);
-    (*dataset).num_items = num_files;
-    (*dataset).images = malloc(sizeof(Image)*num_files);
-    (*dataset).labels = malloc(sizeof(unsigned char)*num_files);
+    struct stat st;
+    if (dataset == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (fread(&num_files, sizeof(int), 1, f1) != 1) {
+        read_failed(f1, filename);
+    }
+    if (fstat(fileno(f1), &st) == -1) {
+        perror(filename);
+        exit(1);
+    }
+    long long expected_size = sizeof(int) + (long long)num_files * RECORD_SIZE;
+    if (num_files < 0 || st.st_size != expected_size) {
+        fprintf(stderr, "%s: %lld bytes, but the header says %d images (%lld bytes)\n",
+                filename, (long long)st.st_size, num_files, expected_size);
+        exit(1);
+    }
 
-    // loop through f1 collecting image and label corresponding to image.
-    int reading = 1;
-    int i = 0;
-    while(reading == 1){
+    (*dataset).num_items = num_files;
+    (*dataset).images = malloc(sizeof(Image)*num_files + 1);
+    (*dataset).labels = malloc(sizeof(unsigned char)*num_files + 1);
+    (*dataset).pixels = malloc((size_t)num_files * NUM_PIXELS + 1);
+    unsigned char *records = malloc((size_t)LOAD_CHUNK * RECORD_SIZE);
+    if ((*dataset).images == NULL || (*dataset).labels == NULL || (*dataset).pixels == NULL
+        || records == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    (*dataset).packed = NULL;
+    (*dataset).pixel_bits = NULL;
+    (*dataset).pixel_words = 0;
+    (*dataset).columns = NULL;
 
-        /**
-         * READ LABEL
-         */
-        unsigned char label;
-        if (fread(&label, sizeof(unsigned char), 1, f1) != 0){
-            (*dataset).labels[i] = label;
+    // read LOAD_CHUNK records at a time, then split them into labels and images
+    for (int first = 0; first < num_files; first += LOAD_CHUNK) {
+        int count = num_files - first < LOAD_CHUNK ? num_files - first : LOAD_CHUNK;
+        if (fread(records, RECORD_SIZE, count, f1) != (size_t)count) {
+            read_failed(f1, filename);
         }
-        else{ // EOF reached
-            reading = 0;
-            continue;
+        for (int i = 0; i < count; i++) {
+            unsigned char *record = records + (size_t)i * RECORD_SIZE;
+            Image *image = &(*dataset).images[first + i];
+            (*dataset).labels[first + i] = record[0];
+            (*image).sx = WIDTH;
+            (*image).sy = WIDTH;
+            (*image).data = (*dataset).pixels + (size_t)(first + i) * NUM_PIXELS;
+            memcpy((*image).data, record + 1, NUM_PIXELS);
         }
+    }
 
-        /**
-        * READ IMAGE
-        */
-        (*dataset).images[i].sx = WIDTH;
-        (*dataset).images[i].sy = WIDTH;
-        (*dataset).images[i].data = malloc(sizeof(unsigned char) * NUM_PIXELS);
+    free(records);
+    fclose(f1);
+    return dataset;
+}
 
-        for (int j = 0; j < NUM_PIXELS; j++){
-            unsigned char pixel;
-            fread(&pixel, sizeof(unsigned char), 1, f1);
-            (*dataset).images[i].data[j] = pixel;
+/**
+ * Build the bit-packed copies of the images in data (see dectree.h). Once
+ * this has been called, the tree is built from the packed bits alone;
+ * the resulting tree is the same.
+ */
+void pack_dataset(Dataset *data) {
+    if (data->packed != NULL) {
+        return;
+    }
+    int words = (data->num_items + 63) / 64;
+    data->packed = calloc((size_t)data->num_items * PACKED_WORDS + 1, sizeof(uint64_t));
+    data->pixel_bits = calloc((size_t)NUM_PIXELS * words + 1, sizeof(uint64_t));
+    if (data->packed == NULL || data->pixel_bits == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    data->pixel_words = words;
+
+    for (int i = 0; i < data->num_items; i++) {
+        unsigned char *pixels = data->images[i].data;
+        uint64_t *row = data->packed + (size_t)i * PACKED_WORDS;
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            if (pixels[p] >= 128) {
+                row[p / 64] |= (uint64_t)1 << (p % 64);
+                data->pixel_bits[(size_t)p * words + i / 64] |= (uint64_t)1 << (i % 64);
+            }
         }
+    }
+}
+
+/* Images transposed at a time by transpose_dataset(): one cache line of
+ * each pixel's row is written per block.
+ */
+#define TRANSPOSE_BLOCK 64
+
+/**
+ * Build the pixel-major copy of the images in data (see dectree.h). Once
+ * this has been called, the lookups of one pixel across the images of a
+ * node (splitting a node, and the candidate pixels of a forest's splits)
+ * read the columns instead of gathering a byte from every image, unless
+ * the dataset has been packed too. The counts over every pixel of a node
+ * still go through the images one row at a time, which is already
+ * sequential. The resulting tree is the same.
+ */
+void transpose_dataset(Dataset *data) {
+    if (data->columns != NULL) {
+        return;
+    }
+    int num_items = data->num_items;
+    data->columns = malloc((size_t)NUM_PIXELS * num_items + 1);
+    if (data->columns == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
-        i++; // go to the next image in f1
+    for (int first = 0; first < num_items; first += TRANSPOSE_BLOCK) {
+        int last = first + TRANSPOSE_BLOCK < num_items ? first + TRANSPOSE_BLOCK : num_items;
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            unsigned char *column = data->columns + (size_t)p * num_items;
+            for (int i = first; i < last; i++) {
+                column[i] = data->images[i].data[p];
+            }
+        }
     }
+}
 
-    return dataset;
+/* Return 1 if pixel of image img_idx in data is >= 128 */
+static inline int pixel_is_high(Dataset *data, int img_idx, int pixel) {
+    if (data->packed != NULL) {
+        uint64_t word = data->packed[(size_t)img_idx * PACKED_WORDS + pixel / 64];
+        return (word >> (pixel % 64)) & 1;
+    }
+    if (data->columns != NULL) {
+        return data->columns[(size_t)pixel * data->num_items + img_idx] >= 128;
+    }
+    return data->images[img_idx].data[pixel] >= 128;
 }
 
 /**
@@ -163,6 +281,265 @@ void get_most_frequent(Dataset *data, int M, int *indices, int *label, int *freq
     return;
 }
 
+/**
+ * Compute the same value as gini_impurity() from the label counts on each
+ * side of a split: a_freq / a_count for the images whose pixel is < 128
+ * and b_freq / b_count for the others, with M = a_count + b_count. The
+ * arithmetic is done in the same order, so the result is bit-for-bit the
+ * same (including NAN when one side is empty).
+ */
+static double gini_from_counts(int *a_freq, int a_count, int *b_freq, int b_count,
+                               int M) {
+    double a_gini = 0, b_gini = 0;
+    for (int i = 0; i < 10; i++) {
+        double a_i = ((double)a_freq[i]) / ((double)a_count);
+        double b_i = ((double)b_freq[i]) / ((double)b_count);
+        a_gini += a_i * (1 - a_i);
+        b_gini += b_i * (1 - b_i);
+    }
+
+    // Weighted average of gini impurity of children
+    return (a_gini * a_count + b_gini * b_count) / M;
+}
+
+/* For each of the M images in indices, add 1 to high[label][pixel] for
+ * every pixel >= 128 and 1 to totals[label]. (From the pixel bytes.)
+ */
+static void count_high_bytes(Dataset *data, int M, int *indices,
+                             int high[10][NUM_PIXELS], int totals[10]) {
+    for (int i = 0; i < M; i++) {
+        int img_idx = indices[i];
+        int label = data->labels[img_idx];
+        unsigned char *pixels = data->images[img_idx].data;
+        int *counts = high[label];
+
+        totals[label]++;
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            counts[p] += pixels[p] >= 128;
+        }
+    }
+}
+
+/* Same as count_high_bytes(), from the packed rows: only the set bits of
+ * each image are visited.
+ */
+static void count_high_packed(Dataset *data, int M, int *indices,
+                              int high[10][NUM_PIXELS], int totals[10]) {
+    for (int i = 0; i < M; i++) {
+        int img_idx = indices[i];
+        int label = data->labels[img_idx];
+        uint64_t *row = data->packed + (size_t)img_idx * PACKED_WORDS;
+        int *counts = high[label];
+
+        totals[label]++;
+        for (int w = 0; w < PACKED_WORDS; w++) {
+            for (uint64_t bits = row[w]; bits != 0; bits &= bits - 1) {
+                counts[w * 64 + __builtin_ctzll(bits)]++;
+            }
+        }
+    }
+}
+
+/* The bitsets are used for a node when M * PACKED_ROW_COST is at least the
+ * number of pixel_bits words: visiting an image's packed row costs about
+ * as much as ANDing and counting that many words (measured on the 60k
+ * training set, where the bitsets win for nodes of more than about 35k
+ * images).
+ */
+#ifndef PACKED_ROW_COST
+#define PACKED_ROW_COST 20
+#endif
+
+/* Mark in members (10 bitsets of pixel_words words, one per label) the M
+ * images in indices, and add 1 to totals[label] for each of them.
+ */
+static void mark_members(Dataset *data, int M, int *indices, uint64_t *members,
+                         int totals[10]) {
+    int words = data->pixel_words;
+    for (int i = 0; i < M; i++) {
+        int img_idx = indices[i];
+        int label = data->labels[img_idx];
+        members[(size_t)label * words + img_idx / 64] |= (uint64_t)1 << (img_idx % 64);
+        totals[label]++;
+    }
+}
+
+/* Set high[label][p] for the pixels p from first to last - 1 to the number
+ * of images in the label's members bitset that have pixel p set: the
+ * popcount of the pixel_bits row ANDed with the bitset. Compiled for the
+ * popcnt instruction too, picked at load time when the CPU has it.
+ */
+__attribute__((target_clones("popcnt", "default")))
+static void count_high_bitsets(Dataset *data, uint64_t *members, int first, int last,
+                               int high[10][NUM_PIXELS]) {
+    int words = data->pixel_words;
+    for (int p = first; p < last; p++) {
+        uint64_t *row = data->pixel_bits + (size_t)p * words;
+        int counts[10] = {0};
+        for (int w = 0; w < words; w++) {
+            uint64_t bits = row[w];
+            if (bits == 0) {
+                continue;
+            }
+            for (int l = 0; l < 10; l++) {
+                counts[l] += __builtin_popcountll(bits & members[(size_t)l * words + w]);
+            }
+        }
+        for (int l = 0; l < 10; l++) {
+            high[l][p] = counts[l];
+        }
+    }
+}
+
+/* The bitsets cost the same whatever the size of the node, so they are
+ * only worth it for large nodes.
+ */
+static int use_bitsets(Dataset *data, int M) {
+    return data->packed != NULL &&
+           (double)M * PACKED_ROW_COST >= (double)data->pixel_words * NUM_PIXELS;
+}
+
+/* With a pool, the counts of a node of at least SPLIT_PARALLEL_MIN images
+ * are split into tasks of SPLIT_CHUNK images each (or, with the bitsets,
+ * SPLIT_PIXEL_CHUNK pixels each).
+ */
+#define SPLIT_PARALLEL_MIN 8192
+#define SPLIT_CHUNK 2048
+#define SPLIT_PIXEL_CHUNK 56
+
+/* One task's share of the counts of a node */
+typedef struct {
+    Dataset *data;
+    int M;                      // Images in this share (image chunks)
+    int *indices;
+    uint64_t *members;          // Node bitsets (pixel chunks)
+    int first, last;            // Pixels in this share (pixel chunks)
+    int (*high)[NUM_PIXELS];
+    int *totals;
+} CountJob;
+
+static void count_chunk_task(void *arg) {
+    CountJob *job = arg;
+    if (job->data->packed != NULL) {
+        count_high_packed(job->data, job->M, job->indices, job->high, job->totals);
+    } else {
+        count_high_bytes(job->data, job->M, job->indices, job->high, job->totals);
+    }
+}
+
+static void count_pixels_task(void *arg) {
+    CountJob *job = arg;
+    count_high_bitsets(job->data, job->members, job->first, job->last, job->high);
+}
+
+/**
+ * Fill in high[label][pixel] (the number of the M images in indices with
+ * that label and pixel >= 128) and totals[label], which must be zero.
+ * With a pool, large nodes are counted in parallel; integer counts add up
+ * the same in any order, so the result does not depend on it.
+ */
+static void count_high(Dataset *data, int M, int *indices, int high[10][NUM_PIXELS],
+                       int totals[10], Pool *pool) {
+    int parallel = pool != NULL && M >= SPLIT_PARALLEL_MIN;
+    int pending = 0;
+
+    if (use_bitsets(data, M)) {
+        uint64_t *members = calloc((size_t)10 * data->pixel_words, sizeof(uint64_t));
+        if (members == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        mark_members(data, M, indices, members, totals);
+        if (!parallel) {
+            count_high_bitsets(data, members, 0, NUM_PIXELS, high);
+        } else {
+            int num_jobs = (NUM_PIXELS + SPLIT_PIXEL_CHUNK - 1) / SPLIT_PIXEL_CHUNK;
+            CountJob jobs[num_jobs];
+            for (int j = 0; j < num_jobs; j++) {
+                jobs[j].data = data;
+                jobs[j].members = members;
+                jobs[j].first = j * SPLIT_PIXEL_CHUNK;
+                jobs[j].last = jobs[j].first + SPLIT_PIXEL_CHUNK < NUM_PIXELS ?
+                               jobs[j].first + SPLIT_PIXEL_CHUNK : NUM_PIXELS;
+                jobs[j].high = high;
+                pool_submit(pool, count_pixels_task, &jobs[j], &pending);
+            }
+            pool_wait(pool, &pending);
+        }
+        free(members);
+        return;
+    }
+
+    if (!parallel) {
+        CountJob job = {data, M, indices, NULL, 0, 0, high, totals};
+        count_chunk_task(&job);
+        return;
+    }
+
+    // Each task counts into its own table; the tables are summed at the end
+    int num_jobs = (M + SPLIT_CHUNK - 1) / SPLIT_CHUNK;
+    int table_size = 10 * NUM_PIXELS + 10;
+    int *tables = calloc((size_t)num_jobs * table_size, sizeof(int));
+    if (tables == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    CountJob jobs[num_jobs];
+    for (int j = 0; j < num_jobs; j++) {
+        int *table = tables + (size_t)j * table_size;
+        jobs[j].data = data;
+        jobs[j].indices = indices + j * SPLIT_CHUNK;
+        jobs[j].M = M - j * SPLIT_CHUNK < SPLIT_CHUNK ? M - j * SPLIT_CHUNK : SPLIT_CHUNK;
+        jobs[j].high = (int (*)[NUM_PIXELS])table;
+        jobs[j].totals = table + 10 * NUM_PIXELS;
+        pool_submit(pool, count_chunk_task, &jobs[j], &pending);
+    }
+    pool_wait(pool, &pending);
+
+    for (int j = 0; j < num_jobs; j++) {
+        int *table = tables + (size_t)j * table_size;
+        for (int l = 0; l < 10; l++) {
+            for (int p = 0; p < NUM_PIXELS; p++) {
+                high[l][p] += table[l * NUM_PIXELS + p];
+            }
+            totals[l] += table[10 * NUM_PIXELS + l];
+        }
+    }
+    free(tables);
+}
+
+/* find_best_split(), counting with the threads of pool (if not NULL) */
+static int find_split(Dataset *data, int M, int *indices, Pool *pool) {
+    int high[10][NUM_PIXELS];   // high[label][pixel]: images with pixel >= 128
+    int totals[10] = {0};       // images with each label
+    memset(high, 0, sizeof(high));
+
+    count_high(data, M, indices, high, totals, pool);
+
+    int split_pixel = 0;
+    double split_pixel_gini = 0;
+
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        int a_freq[10], a_count = 0;
+        int b_freq[10], b_count = 0;
+        for (int l = 0; l < 10; l++) {
+            b_freq[l] = high[l][p];
+            a_freq[l] = totals[l] - b_freq[l];
+            a_count += a_freq[l];
+            b_count += b_freq[l];
+        }
+        double curr_gini = gini_from_counts(a_freq, a_count, b_freq, b_count, M);
+
+        // second OR-condition accounts for the first pixel returning nan, because all images at this pixel is 0
+        if (p == 0 || curr_gini < split_pixel_gini || (isnan(split_pixel_gini) && !isnan(curr_gini))){
+            split_pixel_gini = curr_gini;
+            split_pixel = p;
+        }
+    }
+
+    return split_pixel;
+}
+
 /**
  * Given a subset of M images as defined by their indices, find and return
  * the best pixel to split the data. The best pixel is the one which
@@ -173,22 +550,231 @@ void get_most_frequent(Dataset *data, int M, int *indices, int *label, int *freq
  *  the pixel the M images should be split based on.
  * 
  * If multiple pixels have the same minimal Gini impurity, return the smallest.
+ *
+ * Rather than calling gini_impurity() for every pixel, which reads all M
+ * images 784 times, this makes one pass over the images counting, for
+ * each label and pixel, how many images have that pixel >= 128. The
+ * counts for the < 128 side are the label totals minus those, and every
+ * pixel's impurity is then computed from the counts alone. If the dataset
+ * has been packed, the counts come from the packed bits: the pixel_bits
+ * bitsets for large nodes, the packed rows otherwise.
  */
 int find_best_split(Dataset *data, int M, int *indices) {
-    // TODO: Return the correct pixel
+    return find_split(data, M, indices, NULL);
+}
 
-    int split_pixel = 0;
-    double split_pixel_gini = gini_impurity(data, M, indices, 0);
+/* With a pool, nodes of fewer than SUBTREE_TASK_MIN images are built
+ * serially by the thread that reaches them: below that, a task costs more
+ * to hand over than it saves.
+ */
+#define SUBTREE_TASK_MIN 512
 
-    for (int i = 1; i < NUM_PIXELS; i++){
-        double curr_gini = gini_impurity(data, M, indices, i);
-        // second OR-condition accounts for the first pixel returning nan, because all images at this pixel is 0
-        if (curr_gini < split_pixel_gini || (isnan(split_pixel_gini) && !isnan(curr_gini))){
+/* State shared by everything building one tree */
+typedef struct {
+    Dataset *data;
+    Pool *pool;             // NULL to build serially
+    int pending;            // Subtree tasks not finished yet (atomic)
+    int num_candidates;     // Random pixels tried per split, 0 for all
+    int *indices;           // The tree's index buffer
+    int *scratch;           // As many ints again if the data has columns, else NULL
+} TreeBuild;
+
+/* A subtree to build as a task */
+typedef struct {
+    TreeBuild *build;
+    int M;
+    int *indices;
+    uint64_t seed;          // The subtree root's seed (see child_seed)
+    DTNode **slot;          // Where to store the subtree's root
+} SubtreeJob;
+
+static void subtree_task(void *arg);
+
+/**
+ * Reorder the M image indices in indices so that the images whose pixel is
+ * < 128 come first, and return how many of them there are. Works in place
+ * like the partition step of quicksort, so the order within each side is
+ * not kept (nothing in the tree depends on it).
+ */
+static int partition_indices(Dataset *data, int M, int *indices, int pixel) {
+    int left = 0;
+    int right = M - 1;
+    while (left <= right) {
+        if (!pixel_is_high(data, indices[left], pixel)) {
+            left++;
+        } else {
+            int tmp = indices[left];
+            indices[left] = indices[right];
+            indices[right] = tmp;
+            right--;
+        }
+    }
+    return left;
+}
+
+/**
+ * Same as partition_indices(), but stable, for builds that read the
+ * columns: the left side is packed down in place and the right side goes
+ * through scratch (the same range of the tree's scratch buffer). The
+ * indices start out in increasing order, so every node's stay that way
+ * and the columns are read front to back.
+ */
+static int partition_indices_stable(Dataset *data, int M, int *indices, int *scratch,
+                                    int pixel) {
+    int left = 0;
+    int right = 0;
+    for (int i = 0; i < M; i++) {
+        int img_idx = indices[i];
+        if (!pixel_is_high(data, img_idx, pixel)) {
+            indices[left++] = img_idx;
+        } else {
+            scratch[right++] = img_idx;
+        }
+    }
+    memcpy(indices + left, scratch, sizeof(int) * right);
+    return left;
+}
+
+/* The next value of the splitmix64 sequence whose state is *state */
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* A random number from 0 to n - 1 */
+static int random_below(uint64_t *state, int n) {
+    return (int)(((splitmix64(state) >> 32) * (uint64_t)n) >> 32);
+}
+
+/* The seed of child number k of something whose seed is seed. Each node
+ * of a forest tree gets its seed from its parent's this way (left = 1,
+ * right = 2), so what a node draws only depends on where it is in the
+ * tree, not on which thread builds it or when.
+ */
+static uint64_t child_seed(uint64_t seed, int k) {
+    uint64_t state = seed + (uint64_t)k * 0xD1B54A32D192ED03ULL;
+    return splitmix64(&state);
+}
+
+/* Store in pixels, in increasing order, n distinct pixels chosen at random
+ * from seed (Floyd's algorithm), and return n.
+ */
+static int pick_pixels(uint64_t seed, int n, int *pixels) {
+    uint64_t chosen[PACKED_WORDS] = {0};
+    uint64_t state = seed;
+    for (int j = NUM_PIXELS - n; j < NUM_PIXELS; j++) {
+        int p = random_below(&state, j + 1);
+        if ((chosen[p / 64] >> (p % 64)) & 1) {
+            p = j;
+        }
+        chosen[p / 64] |= (uint64_t)1 << (p % 64);
+    }
+    int count = 0;
+    for (int w = 0; w < PACKED_WORDS; w++) {
+        for (uint64_t bits = chosen[w]; bits != 0; bits &= bits - 1) {
+            pixels[count++] = w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return count;
+}
+
+/* Return the pixel of the n in pixels (in increasing order) that splits
+ * the M images in indices with the smallest Gini impurity (the first one
+ * in the case of a tie), or -1 if none of them splits them at all. The
+ * images are counted pixel by pixel rather than with count_high(): only a
+ * few pixels are looked at, and indices may hold the same image more than
+ * once, which the bitsets cannot count.
+ *
+ * With the columns, each of a few candidates is one forward pass over its
+ * column. Trying all the pixels (the fallback of find_random_split) reads
+ * the rows instead: that is one cache line per 64 pixels of an image,
+ * against one per image and pixel for a small node's columns.
+ */
+static int find_split_among(Dataset *data, int M, int *indices, int *pixels, int n) {
+    int high[10][n];
+    int totals[10] = {0};
+    memset(high, 0, sizeof(high));
+
+    if (data->columns != NULL && data->packed == NULL && n < NUM_PIXELS) {
+        // Group the indices by label (keeping them in increasing order in
+        // each group), then count each group with one pass over the column
+        int *grouped = malloc(sizeof(int) * (M + 1));
+        if (grouped == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        int starts[11] = {0};
+        for (int i = 0; i < M; i++) {
+            totals[data->labels[indices[i]]]++;
+        }
+        for (int l = 0; l < 10; l++) {
+            starts[l + 1] = starts[l] + totals[l];
+        }
+        int next[10];
+        memcpy(next, starts, sizeof(next));
+        for (int i = 0; i < M; i++) {
+            grouped[next[data->labels[indices[i]]]++] = indices[i];
+        }
+        for (int c = 0; c < n; c++) {
+            unsigned char *column = data->columns + (size_t)pixels[c] * data->num_items;
+            for (int l = 0; l < 10; l++) {
+                int count = 0;
+                for (int i = starts[l]; i < starts[l + 1]; i++) {
+                    count += column[grouped[i]] >= 128;
+                }
+                high[l][c] = count;
+            }
+        }
+        free(grouped);
+    } else {
+        for (int i = 0; i < M; i++) {
+            int img_idx = indices[i];
+            int label = data->labels[img_idx];
+            totals[label]++;
+            for (int c = 0; c < n; c++) {
+                high[label][c] += pixel_is_high(data, img_idx, pixels[c]);
+            }
+        }
+    }
+
+    int split_pixel = -1;
+    double split_pixel_gini = 0;
+    for (int c = 0; c < n; c++) {
+        int a_freq[10], a_count = 0;
+        int b_freq[10], b_count = 0;
+        for (int l = 0; l < 10; l++) {
+            b_freq[l] = high[l][c];
+            a_freq[l] = totals[l] - b_freq[l];
+            a_count += a_freq[l];
+            b_count += b_freq[l];
+        }
+        double curr_gini = gini_from_counts(a_freq, a_count, b_freq, b_count, M);
+        if (!isnan(curr_gini) && (split_pixel == -1 || curr_gini < split_pixel_gini)) {
             split_pixel_gini = curr_gini;
-            split_pixel = i;
+            split_pixel = pixels[c];
         }
     }
+    return split_pixel;
+}
 
+/* Split for a node of a forest tree: the best of num_candidates pixels
+ * drawn from the node's seed. If none of them splits the images, every
+ * pixel is tried; return -1 if no pixel does (the images are all the
+ * same, so the node has to be a leaf).
+ */
+static int find_random_split(Dataset *data, int M, int *indices, int num_candidates,
+                             uint64_t seed) {
+    int pixels[NUM_PIXELS];
+    int n = pick_pixels(seed, num_candidates, pixels);
+    int split_pixel = find_split_among(data, M, indices, pixels, n);
+    if (split_pixel == -1 && n < NUM_PIXELS) {
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            pixels[p] = p;
+        }
+        split_pixel = find_split_among(data, M, indices, pixels, NUM_PIXELS);
+    }
     return split_pixel;
 }
 
@@ -196,71 +782,85 @@ int find_best_split(Dataset *data, int M, int *indices) {
  * Create the Decision tree. In each recursive call, we consider the subset of the
  * dataset that correspond to the new node. To represent the subset, we pass 
  * an array of indices of these images in the subset of the dataset, along with 
- * its length M. Be careful to allocate this indices array for any recursive 
- * calls made, and free it when you no longer need the array. In this function,
- * you need to:
+ * its length M. The indices of the whole tree live in one buffer: each node
+ * partitions its range in place and its children work on the two halves,
+ * so no index arrays are allocated per node. In this function, you need to:
  *
  *    - Compute ratio of most frequent image in indices, do not split if the
  *      ration is greater than THRESHOLD_RATIO
  *    - Find the best pixel to split on using `find_best_split`
- *    - Split the data based on whether pixel is less than 128, allocate 
- *      arrays of indices of training images and populate them with the 
- *      subset of indices from M that correspond to which side of the split
- *      they are on
+ *    - Split the data based on whether pixel is less than 128, moving the
+ *      indices of the images on the left side of the split to the front of
+ *      indices (see partition_indices)
  *    - Allocate a new node, set the correct values and return
  *       - If it is a leaf node set `classification`, and both children = NULL.
  *       - Otherwise, set `pixel` and `left`/`right` nodes 
  *         (using build_subtree recursively). 
+ *
+ * With a pool in build, large nodes find their split in parallel and the
+ * left child of a node of at least SUBTREE_TASK_MIN images is built by a
+ * task of its own (which fills in `left` later) while this thread goes
+ * on with the right one. The two children own disjoint ranges of indices.
+ * Every node is computed from its own images alone, so the tree is the
+ * same however the tasks are scheduled.
+ *
+ * For the trees of a forest (build->num_candidates > 0), each node only
+ * tries a random subset of the pixels, drawn from seed (see
+ * find_random_split), and becomes a leaf if none of the pixels splits its
+ * images.
  */
-DTNode *build_subtree(Dataset *data, int M, int *indices) {
+static DTNode *build_subtree(TreeBuild *build, int M, int *indices, uint64_t seed) {
     // TODO: Construct and return the tree
+    Dataset *data = build->data;
     DTNode* subtree = malloc(sizeof(DTNode));
     int label;
     int freq;
     get_most_frequent(data, M, indices, &label, &freq);
     float ratio = freq/(float)M;
 
-
+    int split_pixel = -1;
     if (ratio <= THRESHOLD_RATIO){
-        int split_pixel = find_best_split(data, M, indices);
-        (*subtree).pixel = split_pixel;
-        int left_size = 0;
-        int right_size = 0;
-        int* temp_left_indices = malloc(sizeof(int)*M);
-        int* temp_right_indices = malloc(sizeof(int)*M);
-
-        for (int i = 0; i < M; i++){
-            int img_index = indices[i]; // get corresp. img index
-            Image img = (*data).images[img_index]; // get the image at index
-            if (img.data[split_pixel] < 128){
-                temp_left_indices[left_size] = img_index; // place image index at correct loc
-                left_size++;
-            }
-            else{
-                temp_right_indices[right_size] = img_index;
-                right_size++;
-            }
+        if (build->num_candidates > 0) {
+            split_pixel = find_random_split(data, M, indices, build->num_candidates, seed);
         }
-
-        int* left_indices = malloc(sizeof(int)*left_size);
-        for (int j = 0; j < left_size; j++){
-            left_indices[j] = temp_left_indices[j];
+        else {
+            split_pixel = find_split(data, M, indices, build->pool);
         }
+    }
 
-        int* right_indices = malloc(sizeof(int)*right_size);
-        for (int j = 0; j < right_size; j++){
-            right_indices[j] = temp_right_indices[j];
+    if (split_pixel != -1){
+        (*subtree).pixel = split_pixel;
+        int left_size;
+        if (build->scratch != NULL) {
+            int *scratch = build->scratch + (indices - build->indices);
+            left_size = partition_indices_stable(data, M, indices, scratch, split_pixel);
+        } else {
+            left_size = partition_indices(data, M, indices, split_pixel);
         }
-
-        free(temp_left_indices);
-        free(temp_right_indices);
+        int right_size = M - left_size;
+        int* left_indices = indices;
+        int* right_indices = indices + left_size;
 
         (*subtree).classification = -1; // as specified in dec_tree.pdf
-        (*subtree).left = build_subtree(data, left_size, left_indices);
-        (*subtree).right = build_subtree(data, right_size, right_indices);
-
-        free(left_indices);
-        free(right_indices);
+        if (build->pool != NULL && left_size >= SUBTREE_TASK_MIN) {
+            SubtreeJob *job = malloc(sizeof(SubtreeJob));
+            if (job == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            job->build = build;
+            job->M = left_size;
+            job->indices = left_indices;
+            job->seed = child_seed(seed, 1);
+            job->slot = &(*subtree).left;
+            pool_submit(build->pool, subtree_task, job, &build->pending);
+        }
+        else{
+            (*subtree).left = build_subtree(build, left_size, left_indices,
+                                            child_seed(seed, 1));
+        }
+        (*subtree).right = build_subtree(build, right_size, right_indices,
+                                         child_seed(seed, 2));
     }
     else{ // Is a leaf node
         (*subtree).classification = label;
@@ -276,22 +876,49 @@ DTNode *build_subtree(Dataset *data, int M, int *indices) {
 
 
 
+/* Build the subtree of a SubtreeJob into its slot */
+static void subtree_task(void *arg) {
+    SubtreeJob *job = arg;
+    *job->slot = build_subtree(job->build, job->M, job->indices, job->seed);
+    free(job);
+}
+
 /**
  * This is the function exposed to the user. All you should do here is set
  * up the `indices` array correctly for the entire dataset and call 
  * `build_subtree()` with the correct parameters.
  */
 DTNode *build_dec_tree(Dataset *data) {
+    return build_dec_tree_parallel(data, NULL);
+}
+
+/**
+ * Same as build_dec_tree(), spreading the work over the threads of pool
+ * (or serially if pool is NULL). The tree is the same either way.
+ */
+DTNode *build_dec_tree_parallel(Dataset *data, Pool *pool) {
     // HINT: Make sure you free any data that is not needed anymore
     int size_img_arr = (*data).num_items;
-    int indices[size_img_arr];
+    // With columns, a scratch half for partition_indices_stable()
+    int halves = (*data).columns != NULL ? 2 : 1;
+    int* indices = malloc(sizeof(int) * halves * (size_img_arr + 1));
+    if (indices == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
     for (int i = 0; i < size_img_arr; i++){
         indices[i] = i;
     }
 
-    DTNode* root = build_subtree(data, size_img_arr, indices);
+    int* scratch = halves == 2 ? indices + size_img_arr + 1 : NULL;
+    TreeBuild build = {data, pool, 0, 0, indices, scratch};
+    DTNode* root = build_subtree(&build, size_img_arr, indices, 0);
+    if (pool != NULL) {
+        pool_wait(pool, &build.pending);
+    }
 
+    free(indices);
     return root;
 }
 
@@ -315,6 +942,507 @@ int dec_tree_classify(DTNode *root, Image *img) {
     return classification;
 }
 
+/* Number of nodes in the tree rooted at node */
+static int count_nodes(DTNode *node) {
+    if (node->left == NULL && node->right == NULL) {
+        return 1;
+    }
+    return 1 + count_nodes(node->left) + count_nodes(node->right);
+}
+
+/* Store the tree rooted at node in nodes, starting at index next, and
+ * return the index after its last node.
+ */
+static uint32_t flatten(DTNode *node, FlatNode *nodes, uint32_t next) {
+    FlatNode *flat = &nodes[next];
+    if (node->left == NULL && node->right == NULL) {
+        flat->pixel = FLAT_LEAF;
+        flat->label = node->classification;
+        flat->right = 0;
+        return next + 1;
+    }
+    flat->pixel = node->pixel;
+    flat->label = 0;
+    uint32_t right = flatten(node->left, nodes, next + 1);
+    flat->right = right;
+    return flatten(node->right, nodes, right);
+}
+
+/**
+ * Compile the tree rooted at root into a FlatTree: one array of 8-byte
+ * nodes (see dectree.h) instead of separately allocated DTNodes, which
+ * flat_tree_classify() walks with a loop. The DTNode tree is not changed.
+ */
+FlatTree *compile_dec_tree(DTNode *root) {
+    FlatTree *tree = malloc(sizeof(FlatTree));
+    if (tree == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    tree->num_nodes = count_nodes(root);
+    tree->nodes = malloc(sizeof(FlatNode) * tree->num_nodes);
+    if (tree->nodes == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    flatten(root, tree->nodes, 0);
+    return tree;
+}
+
+/**
+ * Same as dec_tree_classify() on the tree that was compiled into tree.
+ */
+int flat_tree_classify(FlatTree *tree, Image *img) {
+    const FlatNode *nodes = tree->nodes;
+    const unsigned char *pixels = img->data;
+    uint32_t i = 0;
+    while (nodes[i].pixel != FLAT_LEAF) {
+        i = pixels[nodes[i].pixel] < 128 ? i + 1 : nodes[i].right;
+    }
+    return nodes[i].label;
+}
+
+void free_flat_tree(FlatTree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    free(tree->nodes);
+    free(tree);
+}
+
+/* One tree of a forest to build as a task */
+typedef struct {
+    Dataset *data;
+    Pool *pool;
+    int num_candidates;
+    uint64_t seed;          // The tree's seed
+    FlatTree *tree;         // Where to store the compiled tree
+} ForestJob;
+
+/* Build and compile the tree of a ForestJob: draw its bootstrap sample
+ * (num_items images picked at random with replacement) from the tree's
+ * seed and grow the tree on it. With columns, the sample is listed in
+ * increasing order of image, like the indices of a single tree.
+ */
+static void forest_tree_task(void *arg) {
+    ForestJob *job = arg;
+    int num_items = job->data->num_items;
+    int halves = job->data->columns != NULL ? 2 : 1;
+    int *indices = malloc(sizeof(int) * halves * (num_items + 1));
+    if (indices == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int *scratch = NULL;
+
+    uint64_t state = job->seed;
+    if (halves == 2) {
+        // Count the draws of each image in scratch, then list them
+        scratch = indices + num_items + 1;
+        memset(scratch, 0, sizeof(int) * num_items);
+        for (int i = 0; i < num_items; i++) {
+            scratch[random_below(&state, num_items)]++;
+        }
+        int next = 0;
+        for (int i = 0; i < num_items; i++) {
+            for (int j = 0; j < scratch[i]; j++) {
+                indices[next++] = i;
+            }
+        }
+    } else {
+        for (int i = 0; i < num_items; i++) {
+            indices[i] = random_below(&state, num_items);
+        }
+    }
+
+    TreeBuild build = {job->data, job->pool, 0, job->num_candidates, indices, scratch};
+    DTNode *root = build_subtree(&build, num_items, indices, child_seed(job->seed, 0));
+    if (job->pool != NULL) {
+        pool_wait(job->pool, &build.pending);
+    }
+    free(indices);
+
+    FlatTree *flat = compile_dec_tree(root);
+    *job->tree = *flat;
+    free(flat);
+    free_dec_tree(root);
+}
+
+/**
+ * Build a random forest of num_trees trees on data. Each tree is grown on
+ * its own bootstrap sample of the images, and each of its nodes picks the
+ * best split among num_candidates pixels drawn at random (all of them if
+ * num_candidates >= NUM_PIXELS). Every random choice comes from seed, the
+ * tree's number and the node's place in the tree, so the forest only
+ * depends on seed, not on the number of threads.
+ *
+ * With a pool, the trees are built as tasks (and so are their subtrees).
+ */
+Forest *build_forest(Dataset *data, int num_trees, int num_candidates, uint64_t seed,
+                     Pool *pool) {
+    Forest *forest = malloc(sizeof(Forest));
+    ForestJob *jobs = malloc(sizeof(ForestJob) * num_trees);
+    if (forest == NULL || jobs == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    forest->num_trees = num_trees;
+    forest->trees = malloc(sizeof(FlatTree) * num_trees);
+    if (forest->trees == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (num_candidates > NUM_PIXELS) {
+        num_candidates = NUM_PIXELS;
+    }
+
+    int pending = 0;
+    for (int t = 0; t < num_trees; t++) {
+        jobs[t].data = data;
+        jobs[t].pool = pool;
+        jobs[t].num_candidates = num_candidates;
+        jobs[t].seed = child_seed(seed, t);
+        jobs[t].tree = &forest->trees[t];
+        if (pool != NULL) {
+            pool_submit(pool, forest_tree_task, &jobs[t], &pending);
+        } else {
+            forest_tree_task(&jobs[t]);
+        }
+    }
+    if (pool != NULL) {
+        pool_wait(pool, &pending);
+    }
+    free(jobs);
+    return forest;
+}
+
+/* Images voted on together by forest_classify_batch() */
+#define VOTE_BATCH 256
+
+/**
+ * Store in labels[i] the label most of the num_trees trees give images[i]
+ * (the smallest one in the case of a tie), for the n images. The images
+ * go through the trees in batches of VOTE_BATCH, one tree at a time, so
+ * each tree's nodes stay in the cache for the whole batch.
+ */
+void forest_classify_batch(FlatTree *trees, int num_trees, Image *images, int n,
+                           int *labels) {
+    int votes[VOTE_BATCH][10];
+    for (int first = 0; first < n; first += VOTE_BATCH) {
+        int count = n - first < VOTE_BATCH ? n - first : VOTE_BATCH;
+        memset(votes, 0, sizeof(votes));
+        for (int t = 0; t < num_trees; t++) {
+            for (int i = 0; i < count; i++) {
+                votes[i][flat_tree_classify(&trees[t], &images[first + i])]++;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            int label = 0;
+            for (int l = 1; l < 10; l++) {
+                if (votes[i][l] > votes[i][label]) {
+                    label = l;
+                }
+            }
+            labels[first + i] = label;
+        }
+    }
+}
+
+void free_forest(Forest *forest) {
+    if (forest == NULL) {
+        return;
+    }
+    for (int t = 0; t < forest->num_trees; t++) {
+        free(forest->trees[t].nodes);
+    }
+    free(forest->trees);
+    free(forest);
+}
+
+/* Records of a stream (see classify_stream), read as they arrive */
+typedef struct {
+    int fd;
+    int record_size;        // RECORD_SIZE with labels, NUM_PIXELS without
+    unsigned char *buf;     // Room for VOTE_BATCH records
+    int used;               // Bytes of buf handed out by the last read_records()
+    int end;                // Bytes of buf read so far
+} RecordStream;
+
+/* Return how many complete records (at most VOTE_BATCH) are at the start
+ * of s->buf, reading until there is at least one, or 0 at the end of the
+ * stream. Whatever has already arrived is returned without waiting for a
+ * full batch, so a slow producer gets its answers right away.
+ */
+static int read_records(RecordStream *s) {
+    // Move the partial record left over from the last batch to the front
+    memmove(s->buf, s->buf + s->used, s->end - s->used);
+    s->end -= s->used;
+    s->used = 0;
+
+    int capacity = VOTE_BATCH * s->record_size;
+    while (s->end < s->record_size) {
+        ssize_t n = read(s->fd, s->buf + s->end, capacity - s->end);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) {
+            if (s->end != 0) {
+                fprintf(stderr, "The stream ends in the middle of a record\n");
+                exit(1);
+            }
+            return 0;
+        }
+        s->end += n;
+    }
+    int count = s->end / s->record_size;
+    s->used = count * s->record_size;
+    return count;
+}
+
+/**
+ * Classify the images of a stream of records read from fd (stdin, a pipe
+ * or a FIFO) with the num_trees compiled trees as they arrive, and write
+ * each predicted label to out on a line of its own, flushing out after
+ * every batch. A record is laid out like an image of a dataset file (the
+ * label, then the pixels), or is only the pixels if labeled is 0; there
+ * is no header, the stream simply ends. At most VOTE_BATCH records are
+ * held at a time, so the memory used does not depend on the length of
+ * the stream.
+ *
+ * Return the number of images classified, and for a labeled stream store
+ * the number of correct predictions in *num_correct.
+ */
+int classify_stream(FlatTree *trees, int num_trees, int fd, int labeled, FILE *out,
+                    int *num_correct) {
+    RecordStream stream = {fd, labeled ? RECORD_SIZE : NUM_PIXELS, NULL, 0, 0};
+    stream.buf = malloc((size_t)VOTE_BATCH * stream.record_size);
+    if (stream.buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    Image images[VOTE_BATCH];
+    int predictions[VOTE_BATCH];
+    int total = 0;
+    *num_correct = 0;
+
+    int n;
+    while ((n = read_records(&stream)) > 0) {
+        for (int i = 0; i < n; i++) {
+            unsigned char *record = stream.buf + (size_t)i * stream.record_size;
+            images[i].sx = WIDTH;
+            images[i].sy = WIDTH;
+            images[i].data = labeled ? record + 1 : record;
+        }
+        forest_classify_batch(trees, num_trees, images, n, predictions);
+        for (int i = 0; i < n; i++) {
+            fprintf(out, "%d\n", predictions[i]);
+            if (labeled && predictions[i] == stream.buf[(size_t)i * stream.record_size]) {
+                (*num_correct)++;
+            }
+        }
+        if (fflush(out) == EOF) {
+            perror("fflush");
+            exit(1);
+        }
+        total += n;
+    }
+    free(stream.buf);
+    return total;
+}
+
+/* Model files (save_model) hold, in native byte order:
+ *    - a ModelHeader
+ *    - num_trees uint32_t: the index of each tree's root in the nodes
+ *    - num_nodes FlatNodes: the trees one after another, each as laid out
+ *      by compile_dec_tree() (child indices relative to the tree's root)
+ * The checksum is FNV-1a over everything after the header.
+ */
+typedef struct {
+    char magic[8];          // MODEL_MAGIC
+    uint32_t version;       // MODEL_VERSION
+    uint32_t num_pixels;    // NUM_PIXELS the trees were built for
+    uint32_t num_trees;
+    uint32_t num_nodes;     // Nodes in all the trees
+    uint32_t checksum;
+    uint32_t pad;
+} ModelHeader;
+
+#define MODEL_MAGIC "DTMODEL"
+#define MODEL_VERSION 1
+
+static uint32_t fnv1a(uint32_t hash, const void *buf, size_t size) {
+    const unsigned char *bytes = buf;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+#define FNV1A_INIT 2166136261u
+
+/**
+ * Write the num_trees compiled trees of the trees array to filename as a model file.
+ * The file is written under a temporary name and renamed into place, so a
+ * process loading the model never sees half of it. Return 0 on success,
+ * or print an error and return -1.
+ */
+int save_model(const char *filename, FlatTree *trees, int num_trees) {
+    ModelHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MODEL_MAGIC, sizeof(hdr.magic));
+    hdr.version = MODEL_VERSION;
+    hdr.num_pixels = NUM_PIXELS;
+    hdr.num_trees = num_trees;
+
+    uint32_t roots[num_trees];
+    for (int t = 0; t < num_trees; t++) {
+        roots[t] = hdr.num_nodes;
+        hdr.num_nodes += trees[t].num_nodes;
+    }
+    hdr.checksum = fnv1a(FNV1A_INIT, roots, sizeof(roots));
+    for (int t = 0; t < num_trees; t++) {
+        hdr.checksum = fnv1a(hdr.checksum, trees[t].nodes,
+                             sizeof(FlatNode) * trees[t].num_nodes);
+    }
+
+    char tmp_name[strlen(filename) + 16];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", filename, (int)getpid());
+    FILE *f = fopen(tmp_name, "wb");
+    if (f == NULL) {
+        perror(tmp_name);
+        return -1;
+    }
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+             && fwrite(roots, sizeof(roots), 1, f) == 1;
+    for (int t = 0; ok && t < num_trees; t++) {
+        ok = fwrite(trees[t].nodes, sizeof(FlatNode), trees[t].num_nodes, f)
+             == (size_t)trees[t].num_nodes;
+    }
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(tmp_name, filename) == -1) {
+        perror(filename);
+        unlink(tmp_name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Return 1 if the num_nodes nodes of a tree are well formed: every walk
+ * from the root stays inside the tree and ends at a leaf.
+ */
+static int valid_tree(const FlatNode *nodes, uint32_t num_nodes) {
+    for (uint32_t i = 0; i < num_nodes; i++) {
+        if (nodes[i].pixel == FLAT_LEAF) {
+            if (nodes[i].label > 9) {
+                return 0;
+            }
+        } else if (nodes[i].pixel >= NUM_PIXELS || i + 1 >= num_nodes
+                   || nodes[i].right <= i || nodes[i].right >= num_nodes) {
+            return 0;
+        }
+    }
+    return num_nodes > 0;
+}
+
+/**
+ * Map the model file filename read-only and return it, with each tree's
+ * nodes used where they are in the mapping. Processes loading the same
+ * model share its pages. Return NULL (after printing why) if the file
+ * cannot be read or is not a valid model.
+ */
+Model *load_model(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror(filename);
+        return NULL;
+    }
+    ModelHeader hdr;
+    struct stat st;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+        || memcmp(hdr.magic, MODEL_MAGIC, sizeof(hdr.magic)) != 0
+        || hdr.version != MODEL_VERSION
+        || hdr.num_pixels != NUM_PIXELS
+        || hdr.num_trees == 0 || hdr.num_trees > hdr.num_nodes
+        || fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s is not a model file for this version\n", filename);
+        close(fd);
+        return NULL;
+    }
+    size_t size = sizeof(hdr) + sizeof(uint32_t) * (size_t)hdr.num_trees
+                  + sizeof(FlatNode) * (size_t)hdr.num_nodes;
+    if (st.st_size != size) {
+        fprintf(stderr, "%s has the wrong size\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    const uint32_t *roots = (const uint32_t *)((char *)map + sizeof(hdr));
+    FlatNode *nodes = (FlatNode *)(roots + hdr.num_trees);
+    if (fnv1a(FNV1A_INIT, roots, size - sizeof(hdr)) != hdr.checksum) {
+        fprintf(stderr, "%s is corrupt (bad checksum)\n", filename);
+        munmap(map, size);
+        return NULL;
+    }
+
+    Model *model = malloc(sizeof(Model));
+    FlatTree *trees = malloc(sizeof(FlatTree) * hdr.num_trees);
+    if (model == NULL || trees == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (uint32_t t = 0; t < hdr.num_trees; t++) {
+        uint32_t end = t + 1 < hdr.num_trees ? roots[t + 1] : hdr.num_nodes;
+        if (roots[t] >= end || !valid_tree(nodes + roots[t], end - roots[t])) {
+            fprintf(stderr, "%s is corrupt (tree %u)\n", filename, t);
+            free(trees);
+            free(model);
+            munmap(map, size);
+            return NULL;
+        }
+        trees[t].num_nodes = end - roots[t];
+        trees[t].nodes = nodes + roots[t];
+    }
+    model->num_trees = hdr.num_trees;
+    model->trees = trees;
+    model->mapping = map;
+    model->mapped_size = size;
+    return model;
+}
+
+/**
+ * Return the label most of the trees of model give img (the smallest one
+ * in the case of a tie).
+ */
+int model_classify(Model *model, Image *img) {
+    if (model->num_trees == 1) {
+        return flat_tree_classify(&model->trees[0], img);
+    }
+    int label;
+    forest_classify_batch(model->trees, model->num_trees, img, 1, &label);
+    return label;
+}
+
+void free_model(Model *model) {
+    if (model == NULL) {
+        return;
+    }
+    munmap(model->mapping, model->mapped_size);
+    free(model->trees);
+    free(model);
+}
+
 /**
  * This function frees the Decision tree.
  */
@@ -337,10 +1465,10 @@ void free_dec_tree(DTNode *node) {
  */
 void free_dataset(Dataset *data) {
     free((*data).labels);
-    int num_images = (*data).num_items;
-    for (int i = 0; i < num_images; i++){
-        free((*data).images[i].data);
-    }
+    free((*data).packed);
+    free((*data).pixel_bits);
+    free((*data).columns);
+    free((*data).pixels);
     free((*data).images);
     free(data);
 
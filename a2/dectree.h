@@ -22,9 +22,11 @@
  */
 
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "pool.h"
 
 /**
  *  For the recursive call with M images, we want to terminate recursion and 
@@ -66,11 +68,30 @@ typedef struct {
     unsigned char *data;  // Array of `sx * sy` pixel color values [0-255]
 } Image;
 
-/* This struct stores the images / labels in the dataset */
+/* Number of 64-bit words holding one bit per pixel */
+#define PACKED_WORDS ((NUM_PIXELS + 63) / 64)
+
+/* This struct stores the images / labels in the dataset. The tree only
+ * ever tests whether a pixel is < 128, so pack_dataset() can add two
+ * bit-packed copies of the images (bit set = pixel >= 128):
+ *    - packed: PACKED_WORDS words per image, pixel p in bit p % 64 of
+ *      word p / 64 (98 bytes of pixels per image, padded to a word)
+ *    - pixel_bits: one row of pixel_words words per pixel, image i in bit
+ *      i % 64 of word i / 64, so that counting the images of a node that
+ *      have a pixel set is an AND and a popcount per word
+ * and transpose_dataset() can add a pixel-major copy of the pixel bytes:
+ *    - columns: one row of num_items bytes per pixel, so the statistics of
+ *      a node are gathered by streaming through one row at a time
+ */
 typedef struct {
     int num_items;          // Number of images in the dataset
     Image *images;          // Array of `num_items` Image structs
+    unsigned char *pixels;  // The images' data, one after the other
     unsigned char *labels;  // Array of `num_items` labels [0-9]
+    uint64_t *packed;       // `num_items` rows of PACKED_WORDS, or NULL
+    uint64_t *pixel_bits;   // NUM_PIXELS rows of `pixel_words`, or NULL
+    int pixel_words;        // Words per pixel_bits row
+    unsigned char *columns; // NUM_PIXELS rows of `num_items`, or NULL
 } Dataset;
 
 
@@ -82,14 +103,68 @@ typedef struct dt_node {
     struct dt_node *right;  // Right child  (color at `pixel` == 255)
 } DTNode;
 
+/* A node of a compiled tree (see compile_dec_tree). The nodes are stored
+ * in one array, in depth-first order with each node's left child right
+ * after it: most pixels are 0, so the left branch is the one usually
+ * taken and the walk mostly moves forward through memory.
+ */
+#define FLAT_LEAF 0xFFFF
+
+typedef struct {
+    uint16_t pixel;         // Pixel to check, or FLAT_LEAF for a leaf
+    uint16_t label;         // (Leaf nodes) Classification for this node
+    uint32_t right;         // Index of the right child (left is the next node)
+} FlatNode;
+
+typedef struct {
+    int num_nodes;
+    FlatNode *nodes;        // `num_nodes` nodes, the root first
+} FlatTree;
+
+/* A random forest: compiled trees that vote on the label (see build_forest) */
+typedef struct {
+    int num_trees;
+    FlatTree *trees;        // `num_trees` trees
+} Forest;
+
+/* A set of compiled trees loaded from a model file (see save_model). The
+ * nodes are used in place in a read-only mapping of the file.
+ */
+typedef struct {
+    int num_trees;
+    FlatTree *trees;        // `num_trees` trees whose nodes are in mapping
+    void *mapping;
+    size_t mapped_size;
+} Model;
 
 Dataset *load_dataset(const char *filename);
+void pack_dataset(Dataset *data);
+void transpose_dataset(Dataset *data);
 
 void get_most_frequent(Dataset *data, int M, int *indices, int *label, int *freq);
 int find_best_split(Dataset *data, int M, int *indices);
 
 DTNode *build_dec_tree(Dataset *data);
+DTNode *build_dec_tree_parallel(Dataset *data, Pool *pool);
 int dec_tree_classify(DTNode *root, Image *img);
 
+FlatTree *compile_dec_tree(DTNode *root);
+int flat_tree_classify(FlatTree *tree, Image *img);
+void free_flat_tree(FlatTree *tree);
+
+Forest *build_forest(Dataset *data, int num_trees, int num_candidates, uint64_t seed,
+                     Pool *pool);
+void forest_classify_batch(FlatTree *trees, int num_trees, Image *images, int n,
+                           int *labels);
+void free_forest(Forest *forest);
+
+int classify_stream(FlatTree *trees, int num_trees, int fd, int labeled, FILE *out,
+                    int *num_correct);
+
+int save_model(const char *filename, FlatTree *trees, int num_trees);
+Model *load_model(const char *filename);
+int model_classify(Model *model, Image *img);
+void free_model(Model *model);
+
 void free_dataset(Dataset *data);
 void free_dec_tree(DTNode *root);
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+/* A queued call */
+typedef struct {
+    void (*fn)(void *);
+    void *arg;
+    int *pending;
+} PoolTask;
+
+/* One thread's tasks: a ring buffer whose top (head) is stolen from and
+ * whose bottom (tail) the owner pushes to and pops from.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    PoolTask *tasks;
+    int capacity;           // Always a power of 2
+    int head;
+    int tail;
+} PoolDeque;
+
+struct Pool {
+    int num_threads;
+    PoolDeque *deques;      // One per thread; deques[0] is the creator's
+    pthread_t *threads;     // The num_threads - 1 workers
+    pthread_mutex_t lock;   // Protects stop and sleeping on wake
+    pthread_cond_t wake;    // Signalled when a task is queued
+    int queued;             // Tasks in all the deques (atomic)
+    int stop;
+};
+
+#define POOL_INITIAL_CAPACITY 64
+
+/* Index of the calling thread's deque (0 for threads outside the pool) */
+static __thread int pool_thread_id = 0;
+
+static void deque_push(PoolDeque *d, PoolTask task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->capacity) {
+        PoolTask *tasks = malloc(sizeof(PoolTask) * d->capacity * 2);
+        if (tasks == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = d->head; i < d->tail; i++) {
+            tasks[i & (d->capacity * 2 - 1)] = d->tasks[i & (d->capacity - 1)];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->capacity *= 2;
+    }
+    d->tasks[d->tail & (d->capacity - 1)] = task;
+    d->tail++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Take a task from the bottom (bottom = 1) or the top of d. Return 1 and
+ * store it in *task, or return 0 if d is empty.
+ */
+static int deque_take(PoolDeque *d, int bottom, PoolTask *task) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head) {
+        if (bottom) {
+            d->tail--;
+            *task = d->tasks[d->tail & (d->capacity - 1)];
+        } else {
+            *task = d->tasks[d->head & (d->capacity - 1)];
+            d->head++;
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* Pop a task from thread id's own deque, or steal one from the others */
+static int pool_take(Pool *pool, int id, PoolTask *task) {
+    if (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+    for (int i = 0; i < pool->num_threads; i++) {
+        int victim = (id + i) % pool->num_threads;
+        if (deque_take(&pool->deques[victim], victim == id, task)) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void pool_run(PoolTask *task) {
+    task->fn(task->arg);
+    __atomic_sub_fetch(task->pending, 1, __ATOMIC_ACQ_REL);
+}
+
+typedef struct {
+    Pool *pool;
+    int id;
+} PoolWorker;
+
+static void *pool_worker(void *arg) {
+    PoolWorker *worker = arg;
+    Pool *pool = worker->pool;
+    pool_thread_id = worker->id;
+    free(worker);
+
+    for (;;) {
+        PoolTask task;
+        if (pool_take(pool, pool_thread_id, &task)) {
+            pool_run(&task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        int stop = pool->stop;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Create a pool of num_threads threads (the caller and num_threads - 1
+ * workers).
+ */
+Pool *pool_create(int num_threads) {
+    Pool *pool = malloc(sizeof(Pool));
+    if (pool == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    pool->num_threads = num_threads;
+    pool->deques = malloc(sizeof(PoolDeque) * num_threads);
+    pool->threads = malloc(sizeof(pthread_t) * num_threads);
+    if (pool->deques == NULL || pool->threads == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        PoolDeque *d = &pool->deques[i];
+        pthread_mutex_init(&d->lock, NULL);
+        d->capacity = POOL_INITIAL_CAPACITY;
+        d->head = d->tail = 0;
+        d->tasks = malloc(sizeof(PoolTask) * d->capacity);
+        if (d->tasks == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pool->queued = 0;
+    pool->stop = 0;
+
+    for (int i = 1; i < num_threads; i++) {
+        PoolWorker *worker = malloc(sizeof(PoolWorker));
+        if (worker == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        worker->pool = pool;
+        worker->id = i;
+        int err = pthread_create(&pool->threads[i], NULL, pool_worker, worker);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+void pool_submit(Pool *pool, void (*fn)(void *), void *arg, int *pending) {
+    PoolTask task = {fn, arg, pending};
+    __atomic_add_fetch(pending, 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    deque_push(&pool->deques[pool_thread_id], task);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(Pool *pool, int *pending) {
+    while (__atomic_load_n(pending, __ATOMIC_ACQUIRE) > 0) {
+        PoolTask task;
+        if (pool_take(pool, pool_thread_id, &task)) {
+            pool_run(&task);
+        } else {
+            // What is left is running on other threads
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Stop the workers and free the pool. No tasks may be pending.
+ */
+void pool_destroy(Pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->num_threads; i++) {
+        int err = pthread_join(pool->threads[i], NULL);
+        if (err != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+}
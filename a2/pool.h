@@ -0,0 +1,26 @@
+#pragma once
+
+/**
+ * A work-stealing thread pool. Each thread owns a deque of tasks: it
+ * pushes and pops tasks at the bottom of its own deque (so it works depth
+ * first, on data that is still in its cache), and when that is empty it
+ * steals from the top of another thread's deque, where the oldest and
+ * usually largest tasks are.
+ *
+ * A pool of N threads starts N - 1 workers; the thread that created it
+ * counts as the Nth and runs tasks while it waits in pool_wait(). Tasks
+ * may submit more tasks.
+ */
+
+typedef struct Pool Pool;
+
+Pool *pool_create(int num_threads);
+void pool_destroy(Pool *pool);
+
+/* Queue fn(arg) to run on some thread of the pool. *pending is
+ * incremented now and decremented once fn has returned.
+ */
+void pool_submit(Pool *pool, void (*fn)(void *), void *arg, int *pending);
+
+/* Run or steal tasks until *pending drops to 0 */
+void pool_wait(Pool *pool, int *pending);
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "knn.h"
+#include "ssd.h"
+#include "topk.h"
+
+/* Benchmark driver for the kNN hot paths. For each training set size it
+ * times, separately:
+ *    - load_dataset() of datasets/training_<size>.bin
+ *    - distance_euclidean() and distance_cosine() of a query against each
+ *      training image in turn
+ *    - top-K selection of the size distances of a query
+ *    - knn_predict() with each distance, after knn_prepare() as in
+ *      classifier
+ *
+ * Every benchmark is calibrated to run for at least BENCH_MIN_REP_SEC per
+ * repetition, warmed up, then repeated; the min / median / mean / stddev
+ * of the time per operation are reported, with the images/sec and GB/s of
+ * the median. A table goes to stderr and JSON to stdout:
+ *
+ *    make bench
+ * or
+ *    ./bench_knn -n 1,10,1000,10000 -r 10 -K 5 > bench.json
+ */
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_RESULTS 128
+#define BENCH_MIN_REP_SEC 0.01
+
+/* The timing of one benchmark at one size */
+typedef struct {
+    const char *name;
+    int size;               // Training images in the dataset
+    double items;           // Images processed by one operation
+    double bytes;           // Bytes read by one operation
+    long iters;             // Operations per repetition
+    double min, median, mean, stddev; // Seconds per operation
+} BenchResult;
+
+/* Context shared by the benchmark functions */
+typedef struct {
+    char path[256];         // Dataset file for load_dataset
+    Dataset *training;
+    Dataset *queries;
+    double (*fptr)(Image *, Image *);
+    double *dists;          // Distances of queries->images[0] to training
+    int K;
+} BenchCtx;
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static int num_results = 0;
+static int reps = 10;
+static int warmup = 2;
+static volatile double sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Time iters operations starting at operation first */
+static double time_ops(void (*op)(BenchCtx *, long), BenchCtx *ctx, long first,
+                       long iters) {
+    double start = now();
+    for (long i = first; i < first + iters; i++) {
+        op(ctx, i);
+    }
+    return now() - start;
+}
+
+/**
+ * Time op (one operation per call, the second argument counting calls)
+ * and record the result under name. Each operation processes items images
+ * and reads bytes bytes.
+ */
+static void run_bench(const char *name, int size, double items, double bytes,
+                      void (*op)(BenchCtx *, long), BenchCtx *ctx) {
+    if (num_results == BENCH_MAX_RESULTS) {
+        fprintf(stderr, "Too many benchmarks\n");
+        exit(1);
+    }
+
+    // Double the operations per repetition until one takes long enough
+    // to time. This also warms up the caches and the branch predictors.
+    long iters = 1;
+    long done = 0;
+    while (time_ops(op, ctx, done, iters) < BENCH_MIN_REP_SEC) {
+        done += iters;
+        iters *= 2;
+    }
+    done += iters;
+    for (int w = 0; w < warmup; w++) {
+        time_ops(op, ctx, done, iters);
+        done += iters;
+    }
+
+    double samples[reps];
+    for (int r = 0; r < reps; r++) {
+        samples[r] = time_ops(op, ctx, done, iters) / iters;
+        done += iters;
+    }
+    qsort(samples, reps, sizeof(double), cmp_double);
+
+    BenchResult *res = &results[num_results++];
+    res->name = name;
+    res->size = size;
+    res->items = items;
+    res->bytes = bytes;
+    res->iters = iters;
+    res->min = samples[0];
+    res->median = reps % 2 ? samples[reps / 2]
+                           : (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+    res->mean = 0;
+    for (int r = 0; r < reps; r++) {
+        res->mean += samples[r];
+    }
+    res->mean /= reps;
+    res->stddev = 0;
+    for (int r = 0; r < reps; r++) {
+        res->stddev += (samples[r] - res->mean) * (samples[r] - res->mean);
+    }
+    res->stddev = reps > 1 ? sqrt(res->stddev / (reps - 1)) : 0;
+
+    fprintf(stderr, "%-22s %6d %14.1f %14.1f %16.0f %8.3f\n", name, size,
+            res->median * 1e9, res->stddev * 1e9, items / res->median,
+            bytes / res->median / 1e9);
+}
+
+/* The benchmarked operations */
+
+static void op_load(BenchCtx *ctx, long i) {
+    Dataset *data = load_dataset(ctx->path);
+    if (data == NULL) {
+        fprintf(stderr, "The data set in %s could not be loaded\n", ctx->path);
+        exit(1);
+    }
+    sink = data->labels[0];
+    free_dataset(data);
+}
+
+static void op_distance(BenchCtx *ctx, long i) {
+    Dataset *training = ctx->training;
+    sink = ctx->fptr(&training->images[i % training->num_items], &ctx->queries->images[0]);
+}
+
+static void op_topk(BenchCtx *ctx, long i) {
+    TopKItem items[ctx->K];
+    TopK topk;
+    topk_init(&topk, items, ctx->K);
+    for (int j = 0; j < ctx->training->num_items; j++) {
+        topk_push(&topk, ctx->dists[j], j);
+    }
+    topk_sort(&topk);
+    sink = items[0].dist;
+}
+
+static void op_predict(BenchCtx *ctx, long i) {
+    Dataset *queries = ctx->queries;
+    sink = knn_predict(ctx->training, &queries->images[i % queries->num_items],
+                       ctx->K, ctx->fptr);
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-n sizes] [-r reps] [-w warmup] [-K num] [-D datasets_dir]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    char *dir = "datasets";
+    char *size_list = "1,10,1000,10000";
+    int K = 5;
+    while ((opt = getopt(argc, argv, "n:r:w:K:D:")) != -1) {
+        switch (opt) {
+        case 'n':
+            size_list = optarg;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'K':
+            K = atoi(optarg);
+            break;
+        case 'D':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc || reps < 1 || warmup < 0 || K < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    int sizes[BENCH_MAX_SIZES];
+    int num_sizes = 0;
+    for (char *s = size_list; *s != '\0'; ) {
+        if (num_sizes == BENCH_MAX_SIZES) {
+            fprintf(stderr, "At most %d sizes can be given\n", BENCH_MAX_SIZES);
+            exit(1);
+        }
+        char *end;
+        sizes[num_sizes] = strtol(s, &end, 10);
+        if (end == s || sizes[num_sizes] < 1 || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Sizes must be a comma-separated list of positive numbers\n");
+            exit(1);
+        }
+        num_sizes++;
+        s = *end == ',' ? end + 1 : end;
+    }
+
+    BenchCtx ctx;
+    ctx.K = K;
+    snprintf(ctx.path, sizeof(ctx.path), "%s/testing_1000.bin", dir);
+    ctx.queries = load_dataset(ctx.path);
+    if (ctx.queries == NULL) {
+        fprintf(stderr, "The data set in %s could not be loaded\n", ctx.path);
+        exit(1);
+    }
+
+    fprintf(stderr, "ssd kernel: %s, %d repetitions, %d warm-up\n", ssd_kernel(), reps, warmup);
+    fprintf(stderr, "%-22s %6s %14s %14s %16s %8s\n", "benchmark", "size",
+            "ns/op", "stddev", "images/s", "GB/s");
+
+    for (int s = 0; s < num_sizes; s++) {
+        int n = sizes[s];
+        snprintf(ctx.path, sizeof(ctx.path), "%s/training_%d.bin", dir, n);
+        ctx.training = load_dataset(ctx.path);
+        if (ctx.training == NULL) {
+            fprintf(stderr, "The data set in %s could not be loaded\n", ctx.path);
+            exit(1);
+        }
+        n = ctx.training->num_items;
+        knn_prepare(ctx.training);
+
+        ctx.dists = malloc(sizeof(double) * n);
+        if (ctx.dists == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            ctx.dists[i] = distance_euclidean(&ctx.training->images[i], &ctx.queries->images[0]);
+        }
+
+        run_bench("load_dataset", n, n, (double)n * (NUM_PIXELS + 1), op_load, &ctx);
+        ctx.fptr = distance_euclidean;
+        run_bench("distance_euclidean", n, 1, 2 * NUM_PIXELS, op_distance, &ctx);
+        ctx.fptr = distance_cosine;
+        run_bench("distance_cosine", n, 1, 2 * NUM_PIXELS, op_distance, &ctx);
+        run_bench("topk", n, n, (double)n * sizeof(double), op_topk, &ctx);
+        ctx.fptr = distance_euclidean;
+        run_bench("knn_predict_euclidean", n, n, (double)n * NUM_PIXELS, op_predict, &ctx);
+        ctx.fptr = distance_cosine;
+        run_bench("knn_predict_cosine", n, n, (double)n * NUM_PIXELS, op_predict, &ctx);
+
+        free(ctx.dists);
+        free_dataset(ctx.training);
+    }
+    free_dataset(ctx.queries);
+
+    printf("{\n  \"project\": \"a3\",\n  \"ssd_kernel\": \"%s\",\n", ssd_kernel());
+    printf("  \"K\": %d,\n  \"repetitions\": %d,\n  \"warmup\": %d,\n", K, reps, warmup);
+    printf("  \"results\": [\n");
+    for (int r = 0; r < num_results; r++) {
+        BenchResult *res = &results[r];
+        printf("    {\"name\": \"%s\", \"size\": %d, \"iters\": %ld, "
+               "\"ns_per_op\": {\"min\": %.1f, \"median\": %.1f, \"mean\": %.1f, \"stddev\": %.1f}, "
+               "\"images_per_sec\": %.1f, \"gb_per_sec\": %.4f}%s\n",
+               res->name, res->size, res->iters, res->min * 1e9, res->median * 1e9,
+               res->mean * 1e9, res->stddev * 1e9, res->items / res->median,
+               res->bytes / res->median / 1e9, r + 1 < num_results ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
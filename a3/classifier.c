@@ -3,6 +3,9 @@
 #include <unistd.h>      
 #include <sys/types.h>  
 #include <sys/wait.h>  
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include "knn.h"
 #include <math.h>
@@ -14,10 +17,31 @@
 
 /**
  * main() takes in the following command line arguments.
- *   -K <num>:  K value for kNN (default is 1)
+ *   -K <num>:  K value for kNN (default is 1), or a range lo..hi to print
+ *          the number of correct predictions and the accuracy for every K in
+ *          it, from a single scan of the training set
  *   -d <distance metric>: a string for the distance function to use
  *          euclidean or cosine (or initial substring such as "eucl", or "cos")
  *   -p <num_procs>: The number of processes to use to test images
+ *   -t <num_threads>: Use this many threads of this process instead of
+ *          child processes (see knn_run_threads); -p is then ignored, the
+ *          rest works the same
+ *   -a : (With -t) Pin each thread to a CPU of its own
+ *   -o <file>: Write the predicted labels to file, one line per test image
+ *          (see write_predictions). The workers store them in an array
+ *          shared with the parent; with -v a confusion matrix is printed
+ *          for each K
+ *   -H : Put the datasets in huge pages if the system has some (see
+ *          load_dataset_shared; they are always in one shared mapping)
+ *   -c <chunk_size>: Hand out the test images in chunks of this many, each
+ *          to whichever child asks for work next, instead of one fixed range
+ *          per child up front (see distribute_chunks)
+ *   -b : Compute the distances in batches with the GEMM engine (gemm.h)
+ *   -s : Stream mode: read the test images from testing_data ("-" for stdin,
+ *        or a FIFO) as they arrive, and print each predicted label on a line
+ *        of its own as soon as its batch is done (see knn_classify_stream).
+ *        The records have no header; with a single K, in this process
+ *   -u : (With -s) The records are only the pixels, without labels
  *   -v : If this argument is provided, then print additional debugging information
  *        (You are welcome to add print statements that only print with the verbose
  *         option.  We will not be running tests with -v )
@@ -77,27 +101,157 @@ int* get_image_distribution(int num_items, int num_procs){
 
 
 
+/* Read exactly size bytes from fd into buf, or exit with an error if
+ * the child at the other end went away first.
+ */
+void read_child(int fd, void *buf, size_t size, int child) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, (char *)buf + got, size - got);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) {
+            fprintf(stderr, "Child %d exited before sending its results\n", child);
+            exit(1);
+        }
+        got += n;
+    }
+}
+
+/* Write the next chunk of the test images (from *next_idx, at most
+ * chunk_size of the num_items) to a child through fd. Once there are none
+ * left, write an empty chunk, close fd and return 1; otherwise return 0.
+ */
+int send_chunk(int fd, int *next_idx, int num_items, int chunk_size) {
+    int chunk[2];
+    chunk[0] = *next_idx;
+    chunk[1] = num_items - *next_idx < chunk_size ? num_items - *next_idx : chunk_size;
+    *next_idx += chunk[1];
+    if (write(fd, chunk, sizeof(int)*2) == -1) {
+        perror("write");
+        exit(1);
+    }
+    if (chunk[1] > 0) {
+        return 0;
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    return 1;
+}
+
+/**
+ * Dynamic mode: hand out the test images from 0 to num_items - 1 to the
+ * num_procs children in chunks of chunk_size, each chunk going to the
+ * next child that asks for one (see child_handler), so that a slow child
+ * ends up with fewer images instead of holding everyone up. Once a child
+ * has been told there are no more chunks, its ChildResult is read into
+ * results[c]. to_child[c] and from_child[c] are the parent's ends of
+ * child c's pipes, and are closed when done.
+ */
+void distribute_chunks(int num_procs, int *to_child, int *from_child, int num_items,
+                       int chunk_size, ChildResult **results, size_t result_size) {
+    struct pollfd fds[num_procs];
+    int finished[num_procs];    // 1 once the child has been told to stop
+    int next_idx = 0;
+    int remaining = num_procs;
+
+    // Every child starts with a chunk, then gets one per request
+    for (int c = 0; c < num_procs; c++) {
+        fds[c].fd = from_child[c];
+        fds[c].events = POLLIN;
+        finished[c] = send_chunk(to_child[c], &next_idx, num_items, chunk_size);
+    }
+
+    while (remaining > 0) {
+        if (poll(fds, num_procs, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+        for (int c = 0; c < num_procs; c++) {
+            if (fds[c].fd == -1 || fds[c].revents == 0) {
+                continue;
+            }
+            if (finished[c]) {
+                read_child(from_child[c], results[c], result_size, c);
+                if (close(from_child[c]) == -1) {
+                    perror("close");
+                    exit(1);
+                }
+                fds[c].fd = -1; // poll() skips it from now on
+                remaining--;
+            }
+            else {
+                int request;
+                read_child(from_child[c], &request, sizeof(int), c);
+                finished[c] = send_chunk(to_child[c], &next_idx, num_items, chunk_size);
+            }
+        }
+    }
+}
+
 void usage(char *name) {
-    fprintf(stderr, "Usage: %s -v -K <num> -d <distance metric> -p <num_procs> training_list testing_list\n", name);
+    fprintf(stderr, "Usage: %s -v -b -K <num> -d <distance metric> -p <num_procs> [-c <chunk_size>] [-H] [-o <file>] training_list testing_list\n", name);
+    fprintf(stderr, "       %s -v -b -K <num> -d <distance metric> -t <num_threads> [-a] [-c <chunk_size>] [-H] [-o <file>] training_list testing_list\n", name);
+    fprintf(stderr, "       %s -s [-u] -v -b -K <num> -d <distance metric> training_list testing_stream\n", name);
 }
 
 int main(int argc, char *argv[]) {
 
     int opt;
-    int K = 1;             // default value for K
+    int k_min = 1;         // default value for K
+    int k_max = 1;         // k_min unless -K gave a range
     char *dist_metric = "euclidean"; // default distant metric
     int num_procs = 1;     // default number of children to create
+    int num_threads = 0;   // if > 0, use this many threads instead of children
+    int pin = 0;           // if pin is 1, pin each thread to a CPU
+    char *predictions_file = NULL; // if set, write the predictions there
+    int chunk_size = 0;    // if > 0, hand out the test images in chunks this big
+    int huge_pages = 0;    // if huge_pages is 1, map the datasets with huge pages
     int verbose = 0;       // if verbose is 1, print extra debugging statements
-    int total_correct = 0; // Number of correct predictions
+    int batched = 0;       // if batched is 1, use the batched GEMM engine
+    int stream = 0;        // if stream is 1, classify testing_data as it arrives
+    int labeled = 1;       // if labeled is 0, stream records have no label
     double (*fptr)(Image*, Image*); // function pointer
 
-    while((opt = getopt(argc, argv, "vK:d:p:")) != -1) {
+    while((opt = getopt(argc, argv, "vbsuHaK:d:p:t:c:o:")) != -1) {
         switch(opt) {
         case 'v':
             verbose = 1;
             break;
+        case 'b':
+            batched = 1;
+            break;
+        case 's':
+            stream = 1;
+            break;
+        case 'u':
+            labeled = 0;
+            break;
+        case 'H':
+            huge_pages = 1;
+            break;
+        case 'a':
+            pin = 1;
+            break;
+        case 'o':
+            predictions_file = optarg;
+            break;
         case 'K':
-            K = atoi(optarg);
+            if (parse_k_range(optarg, &k_min, &k_max) != 0 || k_min < 1) {
+                fprintf(stderr, "K must be a positive number or a range lo..hi of at most %d values\n",
+                        MAX_K_RANGE);
+                exit(1);
+            }
             break;
         case 'd':
             dist_metric = optarg;
@@ -105,16 +259,34 @@ int main(int argc, char *argv[]) {
         case 'p':
             num_procs = atoi(optarg);
             break;
+        case 't':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                fprintf(stderr, "The number of threads must be a positive number\n");
+                exit(1);
+            }
+            break;
+        case 'c':
+            chunk_size = atoi(optarg);
+            if (chunk_size < 1) {
+                fprintf(stderr, "The chunk size must be a positive number\n");
+                exit(1);
+            }
+            break;
         default:
             usage(argv[0]);
             exit(1);
         }
     }
 
-    if(optind >= argc) {
+    if(optind + 1 >= argc) {
         fprintf(stderr, "Expecting training images file and test images file\n");
         exit(1);
     } 
+    if (stream && k_min != k_max) {
+        fprintf(stderr, "A stream is classified with a single K\n");
+        exit(1);
+    }
 
     char *training_file = argv[optind];
     optind++;
@@ -138,22 +310,62 @@ int main(int argc, char *argv[]) {
         fprintf(stderr,"- Loading datasets...\n");
     }
     
-    Dataset *training = load_dataset(training_file);
+    Dataset *training = load_dataset_shared(training_file, huge_pages);
     if ( training == NULL ) {
         fprintf(stderr, "The data set in %s could not be loaded\n", training_file);
         exit(1);
     }
+    if (k_max > training->num_items) {
+        fprintf(stderr, "K must be at most the number of training images (%d)\n",
+                training->num_items);
+        exit(1);
+    }
 
-    Dataset *testing = load_dataset(testing_file);
+    if (stream) {
+        int fd = strcmp(testing_file, "-") == 0 ? STDIN_FILENO : open(testing_file, O_RDONLY);
+        if (fd == -1) {
+            perror(testing_file);
+            exit(1);
+        }
+        knn_prepare(training);
+        int num_correct;
+        int total = knn_classify_stream(training, fd, labeled, k_min, fptr, batched,
+                                        stdout, &num_correct);
+        if (verbose && labeled) {
+            fprintf(stderr, "Number of correct predictions: %d of %d\n", num_correct, total);
+        }
+        if (fd != STDIN_FILENO && close(fd) == -1) {
+            perror("close");
+            exit(1);
+        }
+        free_dataset(training);
+        return 0;
+    }
+
+    Dataset *testing = load_dataset_shared(testing_file, huge_pages);
     if ( testing == NULL ) {
         fprintf(stderr, "The data set in %s could not be loaded\n", testing_file);
         exit(1);
     }
 
+    // Precompute what the scans need once so that every child shares it
+    knn_prepare(training);
+
+    // Where the workers store every predicted label, shared with the children
+    int num_k = k_max - k_min + 1;
+    unsigned char *predicted = alloc_predictions((*testing).num_items, num_k);
+
+    // The threads split the work and report their results like the children
+    int threaded = num_threads > 0;
+    if (threaded) {
+        num_procs = num_threads;
+    }
+
     // Create the pipes and child processes who will then call child_handler
     if(verbose) {
-        printf("- Creating children ...\n");
+        printf(threaded ? "- Creating threads ...\n" : "- Creating children ...\n");
     }
+    fflush(stdout); // or the children would print it again when they exit
 
     // Used in parent > 0 code block
     int* image_distribution = get_image_distribution((*testing).num_items, num_procs);
@@ -165,7 +377,7 @@ int main(int argc, char *argv[]) {
     // the number of test images to process to their write pipe
     int pipe_fd[num_procs * 2][2];
 
-    for (int i = 0; i < num_procs*2; i+=2){
+    for (int i = 0; !threaded && i < num_procs*2; i+=2){
         if (pipe(pipe_fd[i]) == -1){
             perror("pipe");
             exit(1);
@@ -195,10 +407,14 @@ int main(int argc, char *argv[]) {
             // child inherits file descriptors of parent. close the un-needed ones.
             for (int pipe_no = 0; pipe_no < i; pipe_no+=2){
                 close(pipe_fd[pipe_no+1][0]);
+                if (chunk_size > 0) { // still open in the parent
+                    close(pipe_fd[pipe_no][1]);
+                }
             }
 
 
-            child_handler(training, testing, K, fptr, pipe_fd[i][0], pipe_fd[i+1][1]);
+            child_handler(training, testing, k_min, k_max, fptr, pipe_fd[i][0], pipe_fd[i+1][1],
+                          batched, chunk_size > 0, predicted);
 
             free_dataset(training);
             free_dataset(testing);
@@ -213,8 +429,9 @@ int main(int argc, char *argv[]) {
                 exit(1);
             }
 
+            // (in dynamic mode the chunks are handed out once all children exist)
             int arr_write[2];
-            if (index < (*testing).num_items){
+            if (chunk_size == 0 && index < (*testing).num_items){
 
                 arr_write[0] = index;
                 arr_write[1] = image_distribution[img_distribution_index];
@@ -234,7 +451,7 @@ int main(int argc, char *argv[]) {
                     exit(1);
                 }
             }
-            else{
+            else if (chunk_size == 0){
                 fprintf(stderr, "invalid index");
                 exit(1);
             }
@@ -247,16 +464,54 @@ int main(int argc, char *argv[]) {
     }
 
 
+    // Results of each child
+    size_t result_size = CHILD_RESULT_SIZE(k_min, k_max);
+    ChildResult *results[num_procs];
+    for (int c = 0; c < num_procs; c++) {
+        results[c] = malloc(result_size);
+        if (results[c] == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    if (threaded) {
+        knn_run_threads(training, testing, k_min, k_max, fptr, batched, num_threads,
+                        image_distribution, chunk_size, pin, predicted, results);
+    }
+    // In dynamic mode, keep handing out chunks until the children are done
+    else if (chunk_size > 0) {
+        int to_child[num_procs];
+        int from_child[num_procs];
+        for (int c = 0; c < num_procs; c++) {
+            to_child[c] = pipe_fd[2*c][1];
+            from_child[c] = pipe_fd[2*c+1][0];
+        }
+        distribute_chunks(num_procs, to_child, from_child, (*testing).num_items, chunk_size,
+                          results, result_size);
+    }
+
     // Wait for children to finish
     if(verbose) {
-        printf("- Waiting for children...\n");
+        printf(threaded ? "- Waiting for threads...\n" : "- Waiting for children...\n");
     }
 
 
-    // When the children have finished, read their results from their pipe
+    // Read each child's result from its pipe before waiting for it: a result
+    // bigger than the pipe's buffer would otherwise block the child in
+    // write() while the parent blocks in wait() (dynamic mode already has them)
+    for (int j = 0; !threaded && chunk_size == 0 && j < num_procs * 2; j += 2){
+        read_child(pipe_fd[j+1][0], results[j/2], result_size, j/2);
+
+        // close reading end of pipe_fd[j+1]
+        if (close(pipe_fd[j+1][0]) == -1){
+            perror("close");
+            exit(1);
+        }
+    }
 
     // Ensure children terminated normally
-    for (int i = 0; i < num_procs; i++){
+    for (int i = 0; !threaded && i < num_procs; i++){
         int status;
         if (wait(&status) == -1) {
             perror("wait");
@@ -264,40 +519,73 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Read results from pipe
-    for (int j = 0; j < num_procs * 2; j += 2){
-        int correct;
-        int read_pipe = read(pipe_fd[j+1][0], &correct, sizeof(int));
-        if (read_pipe > 0){
-            total_correct += correct;
+    int total_correct[num_k]; // Number of correct predictions for each K
+    memset(total_correct, 0, sizeof(total_correct));
+    KnnStats stats = {0, 0};
+    for (int c = 0; c < num_procs; c++) {
+        for (int k = 0; k < num_k; k++) {
+            total_correct[k] += results[c]->num_correct[k];
         }
-        else if (read_pipe == 0){
-            fprintf(stderr, "No bytes read");
-            exit(1);
+        stats.candidates += results[c]->stats.candidates;
+        stats.pixels += results[c]->stats.pixels;
+        if (verbose && threaded) {
+            printf("Thread %d: %d chunks on CPU %d\n", c, results[c]->num_chunks,
+                   results[c]->cpu);
         }
-        else{
-            perror("read");
-            exit(1);
+        else if (verbose) {
+            printf("Child %d: %d chunks, %.3f s idle, RSS %ld kB (PSS %ld kB, private %ld kB)\n",
+                   c, results[c]->num_chunks, results[c]->idle_seconds, results[c]->rss_kb,
+                   results[c]->pss_kb, results[c]->private_kb);
         }
+        free(results[c]);
+    }
 
-        // close reading end of pipe_fd[j+1]
-        if (close(pipe_fd[j+1][0]) == -1){
-            perror("close");
-            exit(1);
+    if(verbose) {
+        if (stats.candidates > 0) {
+            printf("Pixels visited per training image: %.1f of %d\n",
+                   (double)stats.pixels / stats.candidates, NUM_PIXELS);
+        }
+        if (num_k == 1) {
+            printf("Number of correct predictions: %d\n", total_correct[0]);
         }
-    }
 
+        // Rows are the true labels, columns the predicted ones
+        for (int k = 0; k < num_k; k++) {
+            int confusion[NUM_LABELS][NUM_LABELS];
+            confusion_matrix(testing, predicted, num_k, k, confusion);
+            printf("Confusion matrix for K=%d (rows: label, columns: prediction):\n",
+                   k_min + k);
+            for (int l = 0; l < NUM_LABELS; l++) {
+                printf("%d:", l);
+                for (int p = 0; p < NUM_LABELS; p++) {
+                    printf(" %5d", confusion[l][p]);
+                }
+                printf("\n");
+            }
+        }
+    }
 
-    if(verbose) {
-        printf("Number of correct predictions: %d\n", total_correct);
+    if (predictions_file != NULL &&
+        write_predictions(predictions_file, testing, predicted, k_min, k_max) == -1) {
+        perror(predictions_file);
+        exit(1);
     }
 
     // This is the only print statement that can occur outside the verbose check
-    printf("%d\n", total_correct);
+    // (with a range of K, one line per K: K, correct predictions, accuracy)
+    if (num_k == 1) {
+        printf("%d\n", total_correct[0]);
+    } else {
+        for (int k = 0; k < num_k; k++) {
+            printf("K=%d %d %.2f%%\n", k_min + k, total_correct[k],
+                   100.0 * total_correct[k] / testing->num_items);
+        }
+    }
 
     // Clean up any memory, open files, or open pipes
     // Note children datasets have already been freed at this point
     free(image_distribution);
+    free_predictions(predicted, (*testing).num_items, num_k);
     free_dataset(testing);
     free_dataset(training);
 
@@ -0,0 +1,35 @@
+#pragma once
+
+/* Batched all-pairs kNN distances computed as an integer matrix product.
+ *
+ * With the squared norms of every image known, the squared euclidean
+ * distance between a query a and a training image b is
+ *     |a - b|^2 = |a|^2 + |b|^2 - 2 a.b
+ * so the distances between a block of queries and a block of training
+ * images only need the dot products between them: a uint8 x uint8 ->
+ * int32 matrix product. gemm_knn() computes it a register tile at a time
+ * (GEMM_MR queries x GEMM_NR training images), keeping a block of
+ * GEMM_TRAIN_BLOCK training images in cache while every packed query of
+ * a GEMM_QUERY_BLOCK visits it, and feeds each distance straight into the
+ * query's TopKRange. All arithmetic is exact, so the distances (and therefore
+ * the neighbours chosen) are the same as with ssd_u8() or
+ * distance_cosine().
+ */
+
+#include "topk.h"
+
+#define GEMM_MR 4               // Queries per register tile
+#define GEMM_NR 3               // Training images per register tile
+#define GEMM_QUERY_BLOCK 64     // Queries packed at a time
+#define GEMM_TRAIN_BLOCK 256    // Training images per cache block
+
+typedef enum {
+    GEMM_EUCLIDEAN_SQUARED, // |a - b|^2, as an exact integer
+    GEMM_COSINE,            // The value distance_cosine() computes
+} GemmMetric;
+
+unsigned int sqnorm_u8(const unsigned char *a, int n);
+
+void gemm_knn(const unsigned char *const *queries, int num_queries,
+              const unsigned char *const *train, const unsigned int *train_norms,
+              int num_train, int n, GemmMetric metric, TopKRange *results);
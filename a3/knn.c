@@ -1,56 +1,135 @@
+#define _GNU_SOURCE // sched_getcpu(), pthread_attr_setaffinity_np()
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <math.h>    
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "knn.h"
+#include "ssd.h"
+#include "topk.h"
+#include "gemm.h"
+
+/* Bytes per image in a dataset file: the label, then the pixels */
+#define RECORD_SIZE (1 + NUM_PIXELS)
+
+/* Images read from a dataset file at a time */
+#define LOAD_CHUNK 4096
+
+/* Size of the huge pages asked for by load_dataset_shared() */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
 /****************************************************************************/
 /* For all the remaining functions you may assume all the images are of the */
 /*     same size, you do not need to perform checks to ensure this.         */
 /****************************************************************************/
-/**
- * load_dataset takes the name of the binary file containing the data and
- * loads it into memory. The binary file format consists of the following:
- *
- *     -   4 bytes : `N`: Number of images / labels in the file
- *     -   1 byte  : Image 1 label
- *     - 784 bytes : Image 1 data (WIDTHxWIDTH)
- *          ...
- *     -   1 byte  : Image N label
- *     - 784 bytes : Image N data (WIDTHxWIDTH)
- *
- * If the filename does not exist then the function will return a NULL pointer.
+/* Put the images, pixels and labels of data (num_items must be set) in
+ * one shared mapping, rounded up to a whole number of huge pages if huge.
  */
-Dataset *load_dataset(const char *filename) {
-    Dataset *data = malloc(sizeof(Dataset));
+static void map_dataset(Dataset *data, int huge) {
+    int n = data->num_items;
+    size_t images_size = ((sizeof(Image) * n + 63) / 64) * 64;
+    size_t pixels_size = (((size_t)n * NUM_PIXELS + 63) / 64) * 64;
+    size_t size = images_size + pixels_size + n + 1;
+
+    void *map = MAP_FAILED;
+    if (huge) {
+        size_t huge_size = ((size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+        map = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) {
+            size = huge_size;
+        }
+    }
+    if (map == MAP_FAILED) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        if (huge) {
+            madvise(map, size, MADV_HUGEPAGE); // only a hint, ignore failures
+        }
+    }
+    data->mapping = map;
+    data->mapped_size = size;
+    data->images = map;
+    data->pixels = (unsigned char *)map + images_size;
+    data->labels = data->pixels + pixels_size;
+}
 
+/* Read a dataset file (see load_dataset), into a shared mapping if shared
+ * (see load_dataset_shared)
+ */
+static Dataset *read_dataset(const char *filename, int shared, int huge) {
     FILE *f = fopen(filename, "rb");
     if(f == NULL) {
         return NULL;
     }
-    if(fread(&data->num_items, sizeof(int), 1, f)==-1){
+    Dataset *data = malloc(sizeof(Dataset));
+    if(data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if(fread(&data->num_items, sizeof(int), 1, f) != 1){
         fprintf(stderr, "Could not read num items from %s\n", filename);
         exit(1);
     }
 
-    data->labels = malloc(sizeof(unsigned char) * data->num_items);
-    data->images = malloc(sizeof(Image) * data->num_items);
+    struct stat st;
+    if(fstat(fileno(f), &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    long long expected = sizeof(int) + (long long)data->num_items * RECORD_SIZE;
+    if(data->num_items < 0 || st.st_size != expected) {
+        fprintf(stderr, "Error: %s is %lld bytes, but its header says %d images (%lld bytes)\n",
+                filename, (long long)st.st_size, data->num_items, expected);
+        exit(1);
+    }
 
-    for (int i = 0; i < data->num_items; i++) {
-        if(fread(data->labels + i, sizeof(unsigned char), 1, f) != 1) {
-            fprintf(stderr, "Error: expecting to read a label from %s\n", filename);
+    int n = data->num_items;
+    data->mapping = NULL;
+    data->mapped_size = 0;
+    if(shared) {
+        map_dataset(data, huge);
+    } else {
+        data->labels = malloc(sizeof(unsigned char) * n + 1);
+        data->images = malloc(sizeof(Image) * n + 1);
+        data->pixels = malloc((size_t)n * NUM_PIXELS + 1);
+    }
+    unsigned char *records = malloc((size_t)LOAD_CHUNK * RECORD_SIZE);
+    if(data->labels == NULL || data->images == NULL || data->pixels == NULL || records == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    data->norms = NULL;
+    data->block_order = NULL;
+
+    for (int first = 0; first < n; first += LOAD_CHUNK) {
+        int count = n - first < LOAD_CHUNK ? n - first : LOAD_CHUNK;
+        if(fread(records, RECORD_SIZE, count, f) != (size_t)count) {
+            fprintf(stderr, "Error: expecting to read images %d to %d from %s\n",
+                    first, first + count - 1, filename);
             exit(1);
         }
-        data->images[i].sx = WIDTH;
-        data->images[i].sy = WIDTH;
-
-        data->images[i].data = malloc(sizeof(unsigned char) * NUM_PIXELS);
-        if(fread(data->images[i].data, sizeof(unsigned char), NUM_PIXELS, f) != NUM_PIXELS) {
-            fprintf(stderr, "Error: expecting to read the pixels from image %d\n", i);
-            exit(1);
+        for (int i = 0; i < count; i++) {
+            unsigned char *record = records + (size_t)i * RECORD_SIZE;
+            Image *img = &data->images[first + i];
+            data->labels[first + i] = record[0];
+            img->sx = WIDTH;
+            img->sy = WIDTH;
+            img->data = data->pixels + (size_t)(first + i) * NUM_PIXELS;
+            memcpy(img->data, record + 1, NUM_PIXELS);
         }
     }
+    free(records);
     if(fclose(f) != 0) {
         perror("fclose");
         exit(1);
@@ -58,23 +137,69 @@ Dataset *load_dataset(const char *filename) {
     return data;
 }
 
+/**
+ * load_dataset takes the name of the binary file containing the data and
+ * loads it into memory. The binary file format consists of the following:
+ *
+ *     -   4 bytes : `N`: Number of images / labels in the file
+ *     -   1 byte  : Image 1 label
+ *     - 784 bytes : Image 1 data (WIDTHxWIDTH)
+ *          ...
+ *     -   1 byte  : Image N label
+ *     - 784 bytes : Image N data (WIDTHxWIDTH)
+ *
+ * If the filename does not exist then the function will return a NULL pointer.
+ *
+ * The file is read LOAD_CHUNK records at a time, and the pixels of all the
+ * images go into one block that the images' data point into. N is checked
+ * against the size of the file before anything is allocated.
+ */
+Dataset *load_dataset(const char *filename) {
+    return read_dataset(filename, 0, 0);
+}
+
+/**
+ * Same as load_dataset(), but the images, pixels and labels are all put in
+ * one shared anonymous mapping (MAP_SHARED), backed by huge pages if huge
+ * is set and the system has some to spare (or else advised to use them).
+ * Processes forked afterwards read the very same physical pages, which no
+ * copy-on-write fault or allocator bookkeeping in a child can split up.
+ */
+Dataset *load_dataset_shared(const char *filename, int huge) {
+    return read_dataset(filename, 1, huge);
+}
+
 
 /** 
  * Return the euclidean distance between the image pixels (as vectors).
  * Specifically  d = sqrt( sum((a[i]-b[i])^2))
+ * The sum is computed exactly in integers by ssd_u8().
  */
 double distance_euclidean(Image *a, Image *b) {
-    double d = 0;
-    for (int i = 0; i < a->sx * a->sy; i++) {
-        d += (a->data[i] - b->data[i]) * (a->data[i] - b->data[i]);
-    }
-    return sqrt(d);
+    return sqrt(ssd_u8(a->data, b->data, a->sx * a->sy));
 }
 
-typedef struct {
-    double dist;
-    int img_idx;
-} Knn_item;
+/* Return the most frequent label of the neighbours kept in topk. If two
+ * are tied, return the smaller label.
+ */
+static int vote(TopK *topk, unsigned char *labels) {
+    // Count the frequencies of the labels
+    int counts[NUM_LABELS] = {0};
+    for (int i = 0; i < topk->size; i++) {
+        counts[labels[topk->items[i].idx]]++;
+    }
+    
+    // Find the most frequent label
+    int max_count = 0, max_label = 1;
+    for (int i = 0; i < NUM_LABELS; i++) {
+        if (counts[i] > max_count) {
+            max_count = counts[i];
+            max_label = i;
+        }
+    }
+
+    return max_label;
+}
 
 /**
  * Given the input training dataset, an image to classify and K as well as a 
@@ -84,50 +209,88 @@ typedef struct {
  *       output the smaller label.
  */ 
 int knn_predict(Dataset *data, Image *input, int K, double (*fptr)(Image *, Image *)) {
+    return knn_predict_stats(data, input, K, fptr, NULL);
+}
 
-    // Array to keep track of K-closest images so far.
-    Knn_item smallest[K];
-    for (int i = 0; i < K; i++) {
-        smallest[i].dist = INFINITY;
+/**
+ * Same as knn_predict(), and add to *stats (unless it is NULL) how many
+ * candidates were compared and how many pixels that took.
+ */
+int knn_predict_stats(Dataset *data, Image *input, int K,
+                      double (*fptr)(Image *, Image *), KnnStats *stats) {
+    int prediction;
+    knn_predict_range(data, input, K, K, fptr, &prediction, stats, NULL);
+    return prediction;
+}
+
+/**
+ * Store in predictions[K - k_min] what knn_predict() would return for each
+ * K from k_min to k_max, with a single scan of data, and add to *stats
+ * (unless it is NULL) how many candidates were compared and how many
+ * pixels that took.
+ *
+ * For the euclidean distance, once the k_max closest so far are known a
+ * candidate only matters if it is strictly closer than the farthest of
+ * them. So if knn_prepare() has been called on data, the scan gives up on
+ * a candidate as soon as its partial sum reaches that distance, visiting
+ * the pixel blocks with the highest variance first (ssd_u8_bounded()).
+ * This never changes which neighbours are chosen.
+ */
+void knn_predict_range(Dataset *data, Image *input, int k_min, int k_max,
+                       double (*fptr)(Image *, Image *), int *predictions,
+                       KnnStats *stats, TopKItem *storage) {
+
+    // The K-closest images so far for each K (see topk.h for how ties are
+    // broken)
+    TopKItem *smallest = storage;
+    if (smallest == NULL) {
+        smallest = malloc(sizeof(TopKItem) * topk_range_items(k_min, k_max));
+        if (smallest == NULL) {
+            perror("malloc");
+            exit(1);
+        }
     }
-    // For each training image, compute the distance using the function pointer
-    for (int i = 0; i < data->num_items; i++) {
+    TopK topks[k_max - k_min + 1];
+    TopKRange range;
+    topk_range_init(&range, topks, smallest, k_min, k_max);
 
-        double dist = fptr(&data->images[i], input);
+    // For euclidean distance, rank by the exact squared distance instead:
+    // sqrt() preserves its order, so the same neighbours are chosen.
+    int squared = fptr == distance_euclidean;
+    int num_pixels = input->sx * input->sy;
+    int bounded = squared && data->block_order != NULL && num_pixels == NUM_PIXELS;
+    long long pixels = 0;
 
-        // Find the maximum distance among the previous K closest
-        double max_dist = -1;
-        int max_index = 0;
-        for (int j = 0; j < K; j++) {
-            if (smallest[j].dist > max_dist) {
-                max_dist = smallest[j].dist;
-                max_index = j;
-            }
+    // For each training image, compute the distance using the function pointer
+    for (int i = 0; i < data->num_items; i++) {
+        double dist;
+        if (bounded) {
+            double bound = topk_range_bound(&range);
+            int visited;
+            dist = ssd_u8_bounded(data->images[i].data, input->data, num_pixels,
+                                  data->block_order, bound < UINT_MAX ? bound : UINT_MAX,
+                                  &visited);
+            pixels += visited;
+        } else if (squared) {
+            dist = ssd_u8(data->images[i].data, input->data, num_pixels);
+            pixels += num_pixels;
+        } else {
+            dist = fptr(&data->images[i], input);
+            pixels += num_pixels;
         }
-
-        // If current distance one of K-closest so far, update the values.
-        if (dist < max_dist) {
-            smallest[max_index].dist = dist;
-            smallest[max_index].img_idx = i;
-        }    
+        topk_range_push(&range, dist, i);
     }
 
-    // Count the frequencies of the labels
-    int counts[10] = {0};
-    for (int i = 0; i < K; i++) {
-        counts[data->labels[smallest[i].img_idx]]++;
+    if (stats != NULL) {
+        stats->candidates += data->num_items;
+        stats->pixels += pixels;
     }
-    
-    // Find the most frequent label
-    int max_count = 0, max_label = 1;
-    for (int i = 0; i < 10; i++) {
-        if (counts[i] > max_count) {
-            max_count = counts[i];
-            max_label = i;
-        }
+    for (int k = 0; k < range.count; k++) {
+        predictions[k] = vote(&topks[k], data->labels);
+    }
+    if (storage == NULL) {
+        free(smallest);
     }
-
-    return max_label;
 }
 
 /** 
@@ -140,18 +303,346 @@ void free_dataset(Dataset *data) {
         return;
     }
 
-    for (int i = 0; i < data->num_items; i++) {
-        free(data->images[i].data);
+    if (data->mapping != NULL) {
+        munmap(data->mapping, data->mapped_size);
+    } else {
+        free(data->pixels);
+        free(data->images);
+        free(data->labels);
     }
-    free(data->images);
-    free(data->labels);
+    free(data->norms);
+    free(data->block_order);
     free(data);
 }
 
+/**
+ * Precompute what the kNN scans need about the training set: the squared
+ * norm of every image for knn_predict_batch(), and the order in which
+ * knn_predict() visits pixel blocks. Call this once, before forking, so
+ * that every child shares the result.
+ */
+void knn_prepare(Dataset *training) {
+    if (training->norms != NULL) {
+        return;
+    }
+    training->norms = malloc(sizeof(unsigned int) * (training->num_items + 1));
+    training->block_order = malloc(sizeof(unsigned short) * (NUM_PIXELS / SSD_BLOCK));
+    const unsigned char **rows = malloc(sizeof(unsigned char *) * (training->num_items + 1));
+    if (training->norms == NULL || training->block_order == NULL || rows == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < training->num_items; i++) {
+        Image *img = &training->images[i];
+        rows[i] = img->data;
+        training->norms[i] = sqnorm_u8(img->data, img->sx * img->sy);
+    }
+    ssd_block_order(rows, training->num_items, NUM_PIXELS, training->block_order);
+    free(rows);
+}
+
+/**
+ * Same as calling knn_predict_range() on each of the n images in inputs,
+ * storing the predictions for image q in predictions[q * (k_max - k_min + 1)]
+ * onwards, but for the euclidean and cosine distances computes the
+ * distances for the whole batch at once with gemm_knn(). knn_prepare()
+ * must have been called on data.
+ */
+void knn_predict_batch(Dataset *data, Image **inputs, int n, int k_min, int k_max,
+                       double (*fptr)(Image *, Image *), int *predictions) {
+    int count = k_max - k_min + 1;
+    if (n <= 0) {
+        return;
+    }
+    if (fptr != distance_euclidean && fptr != distance_cosine) {
+        TopKItem *storage = malloc(sizeof(TopKItem) * topk_range_items(k_min, k_max));
+        if (storage == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int q = 0; q < n; q++) {
+            knn_predict_range(data, inputs[q], k_min, k_max, fptr,
+                              predictions + q * count, NULL, storage);
+        }
+        free(storage);
+        return;
+    }
+
+    size_t items = topk_range_items(k_min, k_max);
+    TopKItem *storage = malloc(sizeof(TopKItem) * items * n);
+    TopK *topks = malloc(sizeof(TopK) * count * n);
+    TopKRange *ranges = malloc(sizeof(TopKRange) * n);
+    const unsigned char **rows = malloc(sizeof(unsigned char *) * (data->num_items + 1));
+    const unsigned char **queries = malloc(sizeof(unsigned char *) * n);
+    if (storage == NULL || topks == NULL || ranges == NULL || rows == NULL ||
+        queries == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < data->num_items; i++) {
+        rows[i] = data->images[i].data;
+    }
+    for (int q = 0; q < n; q++) {
+        queries[q] = inputs[q]->data;
+        topk_range_init(&ranges[q], topks + (size_t)q * count,
+                        storage + (size_t)q * items, k_min, k_max);
+    }
+
+    GemmMetric metric = fptr == distance_euclidean ? GEMM_EUCLIDEAN_SQUARED : GEMM_COSINE;
+    gemm_knn(queries, n, rows, data->norms, data->num_items, NUM_PIXELS, metric, ranges);
+
+    for (int q = 0; q < n; q++) {
+        for (int k = 0; k < count; k++) {
+            predictions[q * count + k] = vote(&ranges[q].topks[k], data->labels);
+        }
+    }
+
+    free(queries);
+    free(rows);
+    free(ranges);
+    free(topks);
+    free(storage);
+}
+
+/**
+ * Predict the labels of the N testing images starting at start_idx for
+ * every K from k_min to k_max, and store in num_correct[K - k_min] how
+ * many are correct. If batched is set, knn_predict_batch() is used (a
+ * query block at a time), otherwise knn_predict_range(), whose counters
+ * are added to *stats unless it is NULL. Unless predicted is NULL, the
+ * label predicted for testing image i with K is also stored in
+ * predicted[i * (k_max - k_min + 1) + K - k_min].
+ */
+void knn_count_correct(Dataset *training, Dataset *testing, int start_idx, int N,
+                       int k_min, int k_max, double (*fptr)(Image *, Image *),
+                       int batched, int *num_correct, unsigned char *predicted,
+                       KnnStats *stats) {
+    int count = k_max - k_min + 1;
+    Image *inputs[GEMM_QUERY_BLOCK];
+    int *predictions = malloc(sizeof(int) * GEMM_QUERY_BLOCK * count);
+    TopKItem *storage = batched ? NULL
+                                : malloc(sizeof(TopKItem) * topk_range_items(k_min, k_max));
+    if (predictions == NULL || (!batched && storage == NULL)) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int k = 0; k < count; k++) {
+        num_correct[k] = 0;
+    }
+
+    for (int start = start_idx; start < start_idx + N; start += GEMM_QUERY_BLOCK) {
+        int n = start_idx + N - start < GEMM_QUERY_BLOCK ? start_idx + N - start : GEMM_QUERY_BLOCK;
+        if (batched) {
+            for (int q = 0; q < n; q++) {
+                inputs[q] = &testing->images[start + q];
+            }
+            knn_predict_batch(training, inputs, n, k_min, k_max, fptr, predictions);
+        } else {
+            for (int q = 0; q < n; q++) {
+                knn_predict_range(training, &testing->images[start + q], k_min, k_max,
+                                  fptr, predictions + q * count, stats, storage);
+            }
+        }
+        for (int q = 0; q < n; q++) {
+            for (int k = 0; k < count; k++) {
+                if (predictions[q * count + k] == testing->labels[start + q]) {
+                    num_correct[k]++;
+                }
+            }
+        }
+        if (predicted != NULL) {
+            for (int i = 0; i < n * count; i++) {
+                predicted[(size_t)start * count + i] = predictions[i];
+            }
+        }
+    }
+    free(predictions);
+    free(storage);
+}
+
+/**
+ * Store in predictions[i] the label predicted with K for each of the n
+ * images, a GEMM_QUERY_BLOCK at a time with knn_predict_batch() if batched
+ * is set, otherwise one at a time with knn_predict().
+ */
+void knn_predict_images(Dataset *training, Image *images, int n, int K,
+                        double (*fptr)(Image *, Image *), int batched, int *predictions) {
+    Image *inputs[GEMM_QUERY_BLOCK];
+    for (int start = 0; start < n; start += GEMM_QUERY_BLOCK) {
+        int count = n - start < GEMM_QUERY_BLOCK ? n - start : GEMM_QUERY_BLOCK;
+        if (batched) {
+            for (int q = 0; q < count; q++) {
+                inputs[q] = &images[start + q];
+            }
+            knn_predict_batch(training, inputs, count, K, K, fptr, predictions + start);
+        } else {
+            for (int q = 0; q < count; q++) {
+                predictions[start + q] = knn_predict(training, &images[start + q], K, fptr);
+            }
+        }
+    }
+}
+
+/* Records of a stream (see knn_classify_stream), read as they arrive */
+typedef struct {
+    int fd;
+    int record_size;        // 1 + NUM_PIXELS with labels, NUM_PIXELS without
+    unsigned char *buf;     // Room for GEMM_QUERY_BLOCK records
+    int used;               // Bytes of buf handed out by the last read_records()
+    int end;                // Bytes of buf read so far
+} RecordStream;
+
+/* Return how many complete records (at most GEMM_QUERY_BLOCK) are at the
+ * start of s->buf, reading until there is at least one, or 0 at the end of
+ * the stream. Whatever has already arrived is returned without waiting
+ * for a full batch, so a slow producer gets its answers right away.
+ */
+static int read_records(RecordStream *s) {
+    // Move the partial record left over from the last batch to the front
+    memmove(s->buf, s->buf + s->used, s->end - s->used);
+    s->end -= s->used;
+    s->used = 0;
+
+    int capacity = GEMM_QUERY_BLOCK * s->record_size;
+    while (s->end < s->record_size) {
+        ssize_t n = read(s->fd, s->buf + s->end, capacity - s->end);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) {
+            if (s->end != 0) {
+                fprintf(stderr, "Error: the stream ends in the middle of a record\n");
+                exit(1);
+            }
+            return 0;
+        }
+        s->end += n;
+    }
+    int count = s->end / s->record_size;
+    s->used = count * s->record_size;
+    return count;
+}
+
+/**
+ * Classify the images of a stream of records read from fd (stdin, a pipe
+ * or a FIFO) as they arrive, and write each predicted label to out on a
+ * line of its own, flushing out after every batch. A record is a label
+ * and NUM_PIXELS bytes, or only the pixels if labeled is 0; there is no
+ * header, the stream simply ends. The records are classified in batches
+ * of up to GEMM_QUERY_BLOCK (with the GEMM engine if batched), so the
+ * memory used does not depend on the length of the stream.
+ *
+ * Return the number of images classified, and for a labeled stream store
+ * the number of correct predictions in *num_correct.
+ */
+int knn_classify_stream(Dataset *training, int fd, int labeled, int K,
+                        double (*fptr)(Image *, Image *), int batched, FILE *out,
+                        int *num_correct) {
+    RecordStream stream = {fd, labeled ? 1 + NUM_PIXELS : NUM_PIXELS, NULL, 0, 0};
+    stream.buf = malloc((size_t)GEMM_QUERY_BLOCK * stream.record_size);
+    if (stream.buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    Image images[GEMM_QUERY_BLOCK];
+    int predictions[GEMM_QUERY_BLOCK];
+    int total = 0;
+    *num_correct = 0;
+
+    int n;
+    while ((n = read_records(&stream)) > 0) {
+        for (int q = 0; q < n; q++) {
+            unsigned char *record = stream.buf + (size_t)q * stream.record_size;
+            images[q].sx = WIDTH;
+            images[q].sy = WIDTH;
+            images[q].data = labeled ? record + 1 : record;
+        }
+        knn_predict_images(training, images, n, K, fptr, batched, predictions);
+        for (int q = 0; q < n; q++) {
+            fprintf(out, "%d\n", predictions[q]);
+            if (labeled && predictions[q] == stream.buf[(size_t)q * stream.record_size]) {
+                (*num_correct)++;
+            }
+        }
+        if (fflush(out) == EOF) {
+            perror("fflush");
+            exit(1);
+        }
+        total += n;
+    }
+    free(stream.buf);
+    return total;
+}
+
+/**
+ * Parse a K argument, either a single value ("7") or an inclusive range
+ * ("1..15"), into *k_min and *k_max. Return 0 on success and -1 if arg is
+ * not of either form, the range is empty or it holds more than MAX_K_RANGE
+ * values. The values are not otherwise checked.
+ */
+int parse_k_range(const char *arg, int *k_min, int *k_max) {
+    char *end;
+    long lo = strtol(arg, &end, 10);
+    long hi = lo;
+    if (end == arg) {
+        return -1;
+    }
+    if (strncmp(end, "..", 2) == 0) {
+        const char *rest = end + 2;
+        hi = strtol(rest, &end, 10);
+        if (end == rest) {
+            return -1;
+        }
+    }
+    if (*end != '\0' || lo > hi || lo < INT_MIN || hi > INT_MAX || hi - lo >= MAX_K_RANGE) {
+        return -1;
+    }
+    *k_min = lo;
+    *k_max = hi;
+    return 0;
+}
+
 
 
 /************************** A3 Code below ************************************/
 
+/* Seconds on a monotonic clock */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Store in result how much memory this process has resident, from
+ * /proc/self/smaps_rollup (all -1 where that cannot be read): its RSS,
+ * its proportional share of it (PSS, where a page shared by n processes
+ * counts for 1/n) and the part of it no other process maps.
+ */
+static void read_memory_usage(ChildResult *result) {
+    result->rss_kb = result->pss_kb = result->private_kb = -1;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) {
+        return;
+    }
+    long private_clean = -1, private_dirty = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        sscanf(line, "Rss: %ld", &result->rss_kb);
+        sscanf(line, "Pss: %ld", &result->pss_kb);
+        sscanf(line, "Private_Clean: %ld", &private_clean);
+        sscanf(line, "Private_Dirty: %ld", &private_dirty);
+    }
+    if (private_clean >= 0 && private_dirty >= 0) {
+        result->private_kb = private_clean + private_dirty;
+    }
+    fclose(f);
+}
+
 /**
  * child_handler will be called by each child process, and is where the 
  * kNN predictions happen. Along with the training and testing datasets, the
@@ -163,48 +654,90 @@ void free_dataset(Dataset *data) {
  *    - Read an integer `start_idx` from the parent (through p_in)
  *    - Read an integer `N` from the parent (through p_in)
  *    - Call `knn_predict()` on testing images `start_idx` to `start_idx+N-1`
- *    - Write an integer representing the number of correct predictions to
- *        the parent (through p_out)
+ *        (or `knn_predict_batch()` if batched is set, see knn_count_correct)
+ *    - Write a ChildResult holding the scan counters and the number of
+ *        correct predictions for each K from k_min to k_max to the parent
+ *        (through p_out)
+ *    - Unless predicted is NULL, store each predicted label in it (see
+ *        knn_count_correct; it must be shared with the parent, see
+ *        alloc_predictions)
+ *
+ * If dynamic is set, the parent hands out the test images a chunk at a
+ * time instead: after each chunk the child writes an int to p_out to ask
+ * for the next one, and an N of 0 means there are no more. The
+ * ChildResult then adds up all the chunks. In both cases it also holds
+ * the number of chunks, the time spent waiting for them, the child's
+ * memory use once it is done and the CPU it ended up on.
  */
-void child_handler(Dataset *training, Dataset *testing, int K, 
-                   double (*fptr)(Image *, Image *),int p_in, int p_out) {
+void child_handler(Dataset *training, Dataset *testing, int k_min, int k_max,
+                   double (*fptr)(Image *, Image *),int p_in, int p_out, int batched,
+                   int dynamic, unsigned char *predicted) {
 
     int arr[2];
     int start_idx;
     int N;
+    int num_k = k_max - k_min + 1;
 
-    int read_pipe = read(p_in, arr, sizeof(int)*2);
-
-    int num_correct = 0;
-    if (read_pipe > 0){
-        start_idx = arr[0];
-        N = arr[1];
-        for (int img_num = start_idx; img_num < (start_idx + N); img_num++){
-            Image curr_image = (*testing).images[img_num];
-            int knn_predict_label = knn_predict(training, &curr_image, K, fptr);
-            if (knn_predict_label == (*testing).labels[img_num]){
-                num_correct++;
-            }
-        }
-    }
-    else if(read_pipe == 0){
-        fprintf(stderr, "No bytes read");
+    size_t result_size = CHILD_RESULT_SIZE(k_min, k_max);
+    ChildResult *result = calloc(1, result_size);
+    int *chunk_correct = malloc(sizeof(int) * num_k);
+    if (result == NULL || chunk_correct == NULL) {
+        perror("calloc");
         exit(1);
     }
-    else{
-        perror("read");
-        exit(1);
+
+    for (;;) {
+        double wait_start = now();
+        int read_pipe = read(p_in, arr, sizeof(int)*2);
+        result->idle_seconds += now() - wait_start;
+
+        if (read_pipe == sizeof(int)*2){
+            start_idx = arr[0];
+            N = arr[1];
+        }
+        else if(read_pipe == -1){
+            perror("read");
+            exit(1);
+        }
+        else{
+            fprintf(stderr, "No bytes read");
+            exit(1);
+        }
+        if (N == 0) { // no more chunks
+            break;
+        }
+
+        knn_count_correct(training, testing, start_idx, N, k_min, k_max, fptr,
+                          batched, chunk_correct, predicted, &result->stats);
+        for (int k = 0; k < num_k; k++) {
+            result->num_correct[k] += chunk_correct[k];
+        }
+        result->num_chunks++;
+        if (!dynamic) {
+            break;
+        }
+
+        // ask for the next chunk
+        int done = 1;
+        if (write(p_out, &done, sizeof(int)) == -1){
+            perror("write");
+            exit(1);
+        }
     }
+    free(chunk_correct);
+    read_memory_usage(result);
+    result->cpu = sched_getcpu();
 
     if (close(p_in) == -1){ // close reading end
         perror("close");
         exit(1);
     }
 
-    if (write(p_out, &num_correct, sizeof(int)) == -1){ // write to pipe
+    if (write(p_out, result, result_size) == -1){ // write to pipe
         perror("write");
         exit(1);
     }
+    free(result);
 
     if (close(p_out) == -1){ // close writing end
         perror("close");
@@ -215,6 +748,200 @@ void child_handler(Dataset *training, Dataset *testing, int K,
     return;
 }
 
+/**
+ * Return room for num_k predicted labels for each of num_items test
+ * images (see knn_count_correct), in a mapping that children forked
+ * afterwards share with the parent, so what they store there needs no
+ * pipe. Free it with free_predictions().
+ */
+unsigned char *alloc_predictions(int num_items, int num_k) {
+    size_t size = (size_t)num_items * num_k;
+    void *predicted = mmap(NULL, size > 0 ? size : 1, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (predicted == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return predicted;
+}
+
+void free_predictions(unsigned char *predicted, int num_items, int num_k) {
+    size_t size = (size_t)num_items * num_k;
+    munmap(predicted, size > 0 ? size : 1);
+}
+
+/* Fill confusion[label][prediction] with how many test images of each
+ * label got each prediction with the k-th of the num_k Ks (counting from
+ * 0, see alloc_predictions)
+ */
+void confusion_matrix(Dataset *testing, unsigned char *predicted, int num_k, int k,
+                      int confusion[NUM_LABELS][NUM_LABELS]) {
+    memset(confusion, 0, sizeof(int) * NUM_LABELS * NUM_LABELS);
+    for (int i = 0; i < testing->num_items; i++) {
+        confusion[testing->labels[i]][predicted[(size_t)i * num_k + k]]++;
+    }
+}
+
+/**
+ * Write the predictions to filename, one line per test image: its index,
+ * its label, then the label predicted with each K from k_min to k_max.
+ * Return 0, or -1 (with errno set) if the file could not be written.
+ */
+int write_predictions(const char *filename, Dataset *testing, unsigned char *predicted,
+                      int k_min, int k_max) {
+    int num_k = k_max - k_min + 1;
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < testing->num_items; i++) {
+        fprintf(f, "%d %d", i, testing->labels[i]);
+        for (int k = 0; k < num_k; k++) {
+            fprintf(f, " %d", predicted[(size_t)i * num_k + k]);
+        }
+        fputc('\n', f);
+    }
+    if (ferror(f)) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* What the threads of knn_run_threads() share */
+typedef struct {
+    Dataset *training;
+    Dataset *testing;
+    int k_min;
+    int k_max;
+    double (*fptr)(Image *, Image *);
+    int batched;
+    int chunk_size;         // If 0, each thread does its one range
+    int next_idx;           // Next test image to hand out (atomic)
+    unsigned char *predicted; // Where the predicted labels go, or NULL
+} ThreadShared;
+
+/* One thread of knn_run_threads() */
+typedef struct {
+    ThreadShared *shared;
+    int start_idx;          // The thread's range if chunk_size is 0
+    int N;
+    ChildResult *result;
+} ThreadJob;
+
+/* The thread version of child_handler(), fed through a ThreadJob */
+static void *thread_handler(void *arg) {
+    ThreadJob *job = arg;
+    ThreadShared *shared = job->shared;
+    ChildResult *result = job->result;
+    int num_k = shared->k_max - shared->k_min + 1;
+    int *chunk_correct = malloc(sizeof(int) * num_k);
+    if (chunk_correct == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (;;) {
+        int start_idx = job->start_idx;
+        int N = job->N;
+        if (shared->chunk_size > 0) {
+            start_idx = __atomic_fetch_add(&shared->next_idx, shared->chunk_size,
+                                           __ATOMIC_RELAXED);
+            N = shared->testing->num_items - start_idx;
+            if (N > shared->chunk_size) {
+                N = shared->chunk_size;
+            }
+        } else if (result->num_chunks > 0) {
+            break;
+        }
+        if (N <= 0) { // no more chunks
+            break;
+        }
+
+        knn_count_correct(shared->training, shared->testing, start_idx, N, shared->k_min,
+                          shared->k_max, shared->fptr, shared->batched, chunk_correct,
+                          shared->predicted, &result->stats);
+        for (int k = 0; k < num_k; k++) {
+            result->num_correct[k] += chunk_correct[k];
+        }
+        result->num_chunks++;
+    }
+    free(chunk_correct);
+    result->cpu = sched_getcpu();
+    return NULL;
+}
+
+/* The n-th CPU (counting from 0, and cycling) of those in allowed */
+static int nth_cpu(cpu_set_t *allowed, int n) {
+    n %= CPU_COUNT(allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowed) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Thread engine: do what the children do (see child_handler) with
+ * num_threads threads of this process instead, which read the datasets in
+ * place and need no pipes. Thread t either classifies the distribution[t]
+ * test images after those of the threads before it or, if chunk_size > 0,
+ * takes chunks of chunk_size from a shared counter until there are none
+ * left. Its ChildResult goes in results[t] (with the memory fields at -1,
+ * as the threads share one address space), and the labels they predict
+ * in predicted as in child_handler(). If pin is set, thread t only runs
+ * on the t-th of the CPUs this process may use.
+ */
+void knn_run_threads(Dataset *training, Dataset *testing, int k_min, int k_max,
+                     double (*fptr)(Image *, Image *), int batched, int num_threads,
+                     int *distribution, int chunk_size, int pin, unsigned char *predicted,
+                     ChildResult **results) {
+    ThreadShared shared = {training, testing, k_min, k_max, fptr, batched, chunk_size, 0,
+                           predicted};
+    ThreadJob jobs[num_threads];
+    pthread_t threads[num_threads];
+    cpu_set_t allowed;
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        exit(1);
+    }
+
+    int start_idx = 0;
+    for (int t = 0; t < num_threads; t++) {
+        memset(results[t], 0, CHILD_RESULT_SIZE(k_min, k_max));
+        results[t]->rss_kb = results[t]->pss_kb = results[t]->private_kb = -1;
+        jobs[t].shared = &shared;
+        jobs[t].start_idx = start_idx;
+        jobs[t].N = distribution[t];
+        jobs[t].result = results[t];
+        start_idx += distribution[t];
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (pin) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(nth_cpu(&allowed, t), &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        int err = pthread_create(&threads[t], &attr, thread_handler, &jobs[t]);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        int err = pthread_join(threads[t], NULL);
+        if (err != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+}
+
 /**
  * This function computes the cosine distance.  It should be called similarly to
  * the function distance() above except the formula that it should evaluate is
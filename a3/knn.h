@@ -7,8 +7,18 @@
  * file, so they do not interfere with anything else.
  */
 
+#include <stdio.h>
+#include "topk.h"
+
 #define WIDTH 28
 #define NUM_PIXELS WIDTH * WIDTH
+#define NUM_LABELS 10
+
+/* Most Ks a range given to parse_k_range() may hold: every K of a range
+ * keeps its own neighbours (see topk.h), so the memory and the time per
+ * prediction grow with the square of its width.
+ */
+#define MAX_K_RANGE 256
 
 /* This struct stores the data for an image */
 typedef struct {
@@ -21,15 +31,75 @@ typedef struct {
 typedef struct {
     int num_items;          // Number of images in the dataset
     Image *images;          // List of `num_items` Image structs
+    unsigned char *pixels;  // The images' data, one after the other
     unsigned char *labels;  // List of `num_items` labels [0-9]
+    unsigned int *norms;    // Squared norm of each image (see knn_prepare)
+    unsigned short *block_order; // Pixel blocks by variance (see knn_prepare)
+    void *mapping;          // Shared mapping holding images, pixels and labels
+    size_t mapped_size;     //   (see load_dataset_shared), or NULL
 } Dataset;
 
+/* Counters for the early-abandon scan in knn_predict_stats() */
+typedef struct {
+    long long candidates;   // Training images compared with a query
+    long long pixels;       // Pixels visited over all those comparisons
+} KnnStats;
+
+/* What each child writes back to the parent */
+typedef struct {
+    KnnStats stats;         // Scan counters over the child's predictions
+    int num_chunks;         // Chunks of test images the child was given
+    double idle_seconds;    // Time spent waiting for them
+    long rss_kb;            // Memory resident in the child at the end
+    long pss_kb;            //   counting shared pages for their share
+    long private_kb;        //   that no other process maps
+    int cpu;                // CPU it was on at the end
+    int num_correct[];      // Number of correct predictions for each K
+} ChildResult;
+
+/* Size of a ChildResult for the Ks from k_min to k_max */
+#define CHILD_RESULT_SIZE(k_min, k_max) \
+    (sizeof(ChildResult) + sizeof(int) * ((k_max) - (k_min) + 1))
+
 double distance_euclidean(Image *a, Image *b);
 
 Dataset *load_dataset(const char *filename);
+Dataset *load_dataset_shared(const char *filename, int huge);
 void free_dataset(Dataset *data);
 
 // New for A3!
 double distance_cosine(Image *a, Image *b);
 int knn_predict(Dataset *data, Image *img, int K, double (*fptr)(Image *,Image *));
-void child_handler(Dataset *training, Dataset *testing, int K, double (*fptr)(Image *, Image *),int p_in, int p_out);
+int knn_predict_stats(Dataset *data, Image *img, int K, double (*fptr)(Image *,Image *),
+                      KnnStats *stats);
+void knn_predict_range(Dataset *data, Image *img, int k_min, int k_max,
+                       double (*fptr)(Image *, Image *), int *predictions,
+                       KnnStats *stats, TopKItem *storage);
+int parse_k_range(const char *arg, int *k_min, int *k_max);
+void child_handler(Dataset *training, Dataset *testing, int k_min, int k_max, double (*fptr)(Image *, Image *),int p_in, int p_out, int batched, int dynamic, unsigned char *predicted);
+void knn_run_threads(Dataset *training, Dataset *testing, int k_min, int k_max,
+                     double (*fptr)(Image *, Image *), int batched, int num_threads,
+                     int *distribution, int chunk_size, int pin, unsigned char *predicted,
+                     ChildResult **results);
+
+// Per-image predictions, shared with the children
+unsigned char *alloc_predictions(int num_items, int num_k);
+void free_predictions(unsigned char *predicted, int num_items, int num_k);
+void confusion_matrix(Dataset *testing, unsigned char *predicted, int num_k, int k,
+                      int confusion[NUM_LABELS][NUM_LABELS]);
+int write_predictions(const char *filename, Dataset *testing, unsigned char *predicted,
+                      int k_min, int k_max);
+
+// Batched engine (gemm.h)
+void knn_prepare(Dataset *training);
+void knn_predict_batch(Dataset *data, Image **inputs, int n, int k_min, int k_max,
+                       double (*fptr)(Image *, Image *), int *predictions);
+void knn_count_correct(Dataset *training, Dataset *testing, int start_idx, int N,
+                       int k_min, int k_max, double (*fptr)(Image *, Image *),
+                       int batched, int *num_correct, unsigned char *predicted,
+                       KnnStats *stats);
+void knn_predict_images(Dataset *training, Image *images, int n, int K,
+                        double (*fptr)(Image *, Image *), int batched, int *predictions);
+int knn_classify_stream(Dataset *training, int fd, int labeled, int K,
+                        double (*fptr)(Image *, Image *), int batched, FILE *out,
+                        int *num_correct);
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include "knn.h"
+#include "serve.h"
+
+/* Load generator for the kNN server (knn_server.c). Opens connections
+ * to it, one thread each, and has every thread send its requests of
+ * batch_size test images one after the other, waiting for each answer
+ * before sending the next. The images are taken from the test set in
+ * order (wrapping around), so that by default the whole set is sent once.
+ * Prints the throughput, the p50 / p99 / max latency of the requests and
+ * the number of correct predictions.
+ *
+ *    ./knn_client -c 4 -B 16 /tmp/knn.sock datasets/testing_data.bin
+ */
+
+/* One connection's share of the load */
+typedef struct {
+    const char *socket_path;
+    Dataset *testing;
+    int batch_size;
+    int first_request;      // Index of its first request over all connections
+    int num_requests;
+    double *latencies;      // Seconds taken by each of its requests
+    long num_correct;
+} ClientJob;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *client_thread(void *arg) {
+    ClientJob *job = arg;
+    Dataset *testing = job->testing;
+    uint32_t n = job->batch_size;
+    unsigned char *request = malloc(sizeof(n) + (size_t)n * NUM_PIXELS);
+    unsigned char *labels = malloc(n);
+    if (request == NULL || labels == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(request, &n, sizeof(n));
+
+    int fd = serve_connect(job->socket_path);
+    if (fd == -1) {
+        perror(job->socket_path);
+        exit(1);
+    }
+    for (int r = 0; r < job->num_requests; r++) {
+        long first = (long)(job->first_request + r) * n;
+        for (uint32_t i = 0; i < n; i++) {
+            Image *img = &testing->images[(first + i) % testing->num_items];
+            memcpy(request + sizeof(n) + (size_t)i * NUM_PIXELS, img->data, NUM_PIXELS);
+        }
+
+        double start = now();
+        uint32_t answered;
+        if (write_full(fd, request, sizeof(n) + (size_t)n * NUM_PIXELS) == -1 ||
+            read_full(fd, &answered, sizeof(answered)) != 1 || answered != n ||
+            read_full(fd, labels, n) != 1) {
+            fprintf(stderr, "The server did not answer request %d\n", job->first_request + r);
+            exit(1);
+        }
+        job->latencies[r] = now() - start;
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (labels[i] == testing->labels[(first + i) % testing->num_items]) {
+                job->num_correct++;
+            }
+        }
+    }
+    close(fd);
+    free(request);
+    free(labels);
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* The p-th percentile (nearest rank) of the n sorted values */
+static double percentile(double *sorted, int n, double p) {
+    int rank = (int)ceil(p / 100 * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s -c <connections> -B <batch_size> -n <requests per connection> socket_path testing_list\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int num_connections = 1;
+    int batch_size = 1;
+    int num_requests = 0;   // 0: enough to send the test set once
+
+    while ((opt = getopt(argc, argv, "c:B:n:")) != -1) {
+        switch (opt) {
+        case 'c':
+            num_connections = atoi(optarg);
+            break;
+        case 'B':
+            batch_size = atoi(optarg);
+            break;
+        case 'n':
+            num_requests = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind + 2 != argc || num_connections < 1 || batch_size < 1 ||
+        batch_size > SERVE_MAX_BATCH || num_requests < 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+    char *socket_path = argv[optind];
+    char *testing_file = argv[optind + 1];
+
+    Dataset *testing = load_dataset(testing_file);
+    if (testing == NULL || testing->num_items == 0) {
+        fprintf(stderr, "The data set in %s could not be loaded\n", testing_file);
+        exit(1);
+    }
+    if (num_requests == 0) {
+        long per_round = (long)batch_size * num_connections;
+        num_requests = (testing->num_items + per_round - 1) / per_round;
+    }
+
+    int total_requests = num_requests * num_connections;
+    double *latencies = malloc(sizeof(double) * total_requests);
+    ClientJob jobs[num_connections];
+    pthread_t threads[num_connections];
+    if (latencies == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    double start = now();
+    for (int c = 0; c < num_connections; c++) {
+        jobs[c].socket_path = socket_path;
+        jobs[c].testing = testing;
+        jobs[c].batch_size = batch_size;
+        jobs[c].first_request = c * num_requests;
+        jobs[c].num_requests = num_requests;
+        jobs[c].latencies = latencies + (size_t)c * num_requests;
+        jobs[c].num_correct = 0;
+        int err = pthread_create(&threads[c], NULL, client_thread, &jobs[c]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    long num_correct = 0;
+    for (int c = 0; c < num_connections; c++) {
+        int err = pthread_join(threads[c], NULL);
+        if (err != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err));
+            exit(1);
+        }
+        num_correct += jobs[c].num_correct;
+    }
+    double elapsed = now() - start;
+
+    long num_images = (long)total_requests * batch_size;
+    qsort(latencies, total_requests, sizeof(double), compare_doubles);
+    printf("%d connections x %d requests of %d images in %.3f s\n",
+           num_connections, num_requests, batch_size, elapsed);
+    printf("Throughput: %.1f requests/s, %.1f images/s\n",
+           total_requests / elapsed, num_images / elapsed);
+    printf("Latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           1e3 * percentile(latencies, total_requests, 50),
+           1e3 * percentile(latencies, total_requests, 99),
+           1e3 * latencies[total_requests - 1]);
+    printf("Correct predictions: %ld of %ld\n", num_correct, num_images);
+
+    free(latencies);
+    free_dataset(testing);
+    return 0;
+}
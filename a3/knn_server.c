@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "knn.h"
+#include "serve.h"
+
+/* Persistent kNN server. Loads the training set once (in one shared
+ * mapping, see load_dataset_shared), prepares it, then pre-forks a pool
+ * of workers that all accept connections on one UNIX domain socket and
+ * answer batches of images with their predicted labels (see serve.h for
+ * the protocol). Each worker serves one connection at a time and drops it
+ * after SERVE_IDLE_TIMEOUT seconds without a request. A worker that dies
+ * is replaced, after a growing delay if it keeps dying right after it
+ * starts; SIGINT or SIGTERM stops the workers and removes the socket.
+ *
+ *    ./knn_server -K 3 -w 4 -b /tmp/knn.sock datasets/training_data.bin
+ * and then, for instance
+ *    ./knn_client -c 4 -B 16 /tmp/knn.sock datasets/testing_data.bin
+ */
+
+static volatile sig_atomic_t stop = 0;
+
+/* A worker that exits within WORKER_MIN_LIFETIME seconds of its start is
+ * restarted after a delay, doubled each time it happens again in a row up
+ * to WORKER_MAX_DELAY seconds, instead of being forked over and over.
+ */
+#define WORKER_MIN_LIFETIME 1
+#define WORKER_MAX_DELAY 32
+
+/* SIGINT, SIGTERM, SIGCHLD and SIGALRM (for restart delays): the parent
+ * keeps them blocked except while it sleeps in sigsuspend(), so none can
+ * slip in between its check of stop and going to sleep.
+ */
+static sigset_t server_signals;
+
+static void handle_signal(int sig) {
+    if (sig == SIGINT || sig == SIGTERM) {
+        stop = 1;
+    }
+}
+
+/* What every worker needs to answer requests */
+typedef struct {
+    Dataset *training;
+    int K;
+    double (*fptr)(Image *, Image *);
+    int batched;
+    int verbose;
+} Server;
+
+/* Answer the requests of one client until it closes the connection,
+ * sends a malformed request or stays idle for SERVE_IDLE_TIMEOUT seconds.
+ * The buffers hold SERVE_MAX_BATCH images.
+ */
+static void serve_connection(Server *server, int fd, int worker, unsigned char *pixels,
+                             Image *images, int *predictions, unsigned char *labels) {
+    int num_requests = 0;
+    long num_images = 0;
+    for (;;) {
+        uint32_t n;
+        int r = read_full(fd, &n, sizeof(n));
+        if (r == 0) {
+            break;
+        }
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (server->verbose) {
+                fprintf(stderr, "Worker %d: idle for %d s, closing the connection\n",
+                        worker, SERVE_IDLE_TIMEOUT);
+            }
+            break;
+        }
+        if (r == -1 || n < 1 || n > SERVE_MAX_BATCH ||
+            read_full(fd, pixels, (size_t)n * NUM_PIXELS) != 1) {
+            if (server->verbose) {
+                fprintf(stderr, "Worker %d: bad request, closing the connection\n", worker);
+            }
+            break;
+        }
+
+        knn_predict_images(server->training, images, n, server->K, server->fptr,
+                           server->batched, predictions);
+        for (uint32_t i = 0; i < n; i++) {
+            labels[i] = predictions[i];
+        }
+        if (write_full(fd, &n, sizeof(n)) == -1 || write_full(fd, labels, n) == -1) {
+            if (server->verbose) {
+                fprintf(stderr, "Worker %d: %s, closing the connection\n", worker,
+                        strerror(errno));
+            }
+            break;
+        }
+        num_requests++;
+        num_images += n;
+    }
+    if (server->verbose) {
+        fprintf(stderr, "Worker %d: connection closed after %d requests, %ld images\n",
+                worker, num_requests, num_images);
+    }
+}
+
+/* Body of worker process number worker: accept and serve connections */
+static void worker_loop(Server *server, int listen_fd, int worker) {
+    unsigned char *pixels = malloc((size_t)SERVE_MAX_BATCH * NUM_PIXELS);
+    Image *images = malloc(sizeof(Image) * SERVE_MAX_BATCH);
+    int *predictions = malloc(sizeof(int) * SERVE_MAX_BATCH);
+    unsigned char *labels = malloc(SERVE_MAX_BATCH);
+    if (pixels == NULL || images == NULL || predictions == NULL || labels == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < SERVE_MAX_BATCH; i++) {
+        images[i].sx = WIDTH;
+        images[i].sy = WIDTH;
+        images[i].data = pixels + (size_t)i * NUM_PIXELS;
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+        if (serve_set_timeout(fd, SERVE_IDLE_TIMEOUT) == -1) {
+            perror("setsockopt");
+            exit(1);
+        }
+        serve_connection(server, fd, worker, pixels, images, predictions, labels);
+        close(fd);
+    }
+}
+
+/* Fork worker number worker and return its pid. The worker inherits the
+ * parent's blocked server_signals and only unblocks them once it has put
+ * back their default action, so that a stop signal sent right after the
+ * fork kills it instead of reaching handle_signal.
+ */
+static pid_t start_worker(Server *server, int listen_fd, int worker) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        sigprocmask(SIG_UNBLOCK, &server_signals, NULL);
+        worker_loop(server, listen_fd, worker);
+        exit(0);
+    }
+    return pid;
+}
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s -v -b -K <num> -d <distance metric> -w <num_workers> socket_path training_list\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int num_workers = 1;
+    char *dist_metric = "euclidean";
+    Server server = {NULL, 1, distance_euclidean, 0, 0};
+
+    while ((opt = getopt(argc, argv, "vbK:d:w:")) != -1) {
+        switch (opt) {
+        case 'v':
+            server.verbose = 1;
+            break;
+        case 'b':
+            server.batched = 1;
+            break;
+        case 'K':
+            server.K = atoi(optarg);
+            if (server.K < 1) {
+                fprintf(stderr, "K must be a positive number\n");
+                exit(1);
+            }
+            break;
+        case 'd':
+            dist_metric = optarg;
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            if (num_workers < 1) {
+                fprintf(stderr, "The number of workers must be a positive number\n");
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind + 2 != argc) {
+        usage(argv[0]);
+        exit(1);
+    }
+    char *socket_path = argv[optind];
+    char *training_file = argv[optind + 1];
+
+    if (strncmp(dist_metric, "euclidean", strlen(dist_metric)) == 0) {
+        server.fptr = distance_euclidean;
+    } else if (strncmp(dist_metric, "cosine", strlen(dist_metric)) == 0) {
+        server.fptr = distance_cosine;
+    } else {
+        fprintf(stderr, "Valid functions: euclidean, eucl, cosine, or cos\n");
+        exit(1);
+    }
+
+    server.training = load_dataset_shared(training_file, 0);
+    if (server.training == NULL) {
+        fprintf(stderr, "The data set in %s could not be loaded\n", training_file);
+        exit(1);
+    }
+    if (server.K > server.training->num_items) {
+        fprintf(stderr, "K must be at most the number of training images (%d)\n",
+                server.training->num_items);
+        exit(1);
+    }
+    knn_prepare(server.training);
+
+    int listen_fd = serve_listen(socket_path);
+    if (listen_fd == -1) {
+        perror(socket_path);
+        exit(1);
+    }
+
+    // A client that goes away mid-answer must not kill its worker
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t sleep_mask; // what sigsuspend() unblocks
+    sigemptyset(&server_signals);
+    sigaddset(&server_signals, SIGINT);
+    sigaddset(&server_signals, SIGTERM);
+    sigaddset(&server_signals, SIGCHLD);
+    sigaddset(&server_signals, SIGALRM);
+    sigprocmask(SIG_BLOCK, &server_signals, &sleep_mask);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL); // so that sigsuspend() returns
+    sigaction(SIGALRM, &sa, NULL);
+
+    pid_t workers[num_workers];     // 0 while waiting to be restarted
+    time_t started[num_workers];
+    time_t restart_at[num_workers];
+    int delay[num_workers];         // Seconds before the next restart
+    for (int w = 0; w < num_workers; w++) {
+        workers[w] = start_worker(&server, listen_fd, w);
+        started[w] = time(NULL);
+        delay[w] = 0;
+    }
+    if (server.verbose) {
+        fprintf(stderr, "- Serving %d training images on %s with %d workers\n",
+                server.training->num_items, socket_path, num_workers);
+    }
+
+    // Replace any worker that dies until told to stop. The signals are only
+    // unblocked inside sigsuspend(), which returns once one has been handled.
+    while (!stop) {
+        sigsuspend(&sleep_mask);
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int w = 0; w < num_workers; w++) {
+                if (workers[w] == pid) {
+                    time_t now = time(NULL);
+                    if (now - started[w] < WORKER_MIN_LIFETIME) {
+                        delay[w] = delay[w] == 0 ? 1 : 2 * delay[w];
+                        if (delay[w] > WORKER_MAX_DELAY) {
+                            delay[w] = WORKER_MAX_DELAY;
+                        }
+                    } else {
+                        delay[w] = 0;
+                    }
+                    if (delay[w] == 0) {
+                        fprintf(stderr, "Worker %d exited, starting a new one\n", w);
+                    } else {
+                        fprintf(stderr, "Worker %d exited, starting a new one in %d s\n",
+                                w, delay[w]);
+                    }
+                    workers[w] = 0;
+                    restart_at[w] = now + delay[w];
+                }
+            }
+        }
+        if (stop) {
+            break;
+        }
+
+        // Start the workers that are due, and wake up for the next one
+        time_t now = time(NULL);
+        unsigned int next = 0;
+        for (int w = 0; w < num_workers; w++) {
+            if (workers[w] != 0) {
+                continue;
+            }
+            if (restart_at[w] <= now) {
+                workers[w] = start_worker(&server, listen_fd, w);
+                started[w] = now;
+            } else if (next == 0 || restart_at[w] - now < next) {
+                next = restart_at[w] - now;
+            }
+        }
+        if (next != 0) {
+            alarm(next);
+        }
+    }
+
+    for (int w = 0; w < num_workers; w++) {
+        if (workers[w] != 0) {
+            kill(workers[w], SIGTERM);
+        }
+    }
+    for (int w = 0; w < num_workers; w++) {
+        if (workers[w] != 0) {
+            waitpid(workers[w], NULL, 0);
+        }
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    free_dataset(server.training);
+    if (server.verbose) {
+        fprintf(stderr, "- Stopped\n");
+    }
+    return 0;
+}
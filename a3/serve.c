@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "serve.h"
+
+/**
+ * Read exactly size bytes from fd into buf. Return 1 once they are all
+ * read, 0 if fd is at its end before the first byte, and -1 on an error or
+ * if it ends part way (errno is then set, to EPIPE for a short read).
+ */
+int read_full(int fd, void *buf, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, (char *)buf + got, size - got);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            if (got == 0) {
+                return 0;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+        got += n;
+    }
+    return 1;
+}
+
+/* Write all size bytes of buf to fd. Return 0, or -1 on an error. */
+int write_full(int fd, const void *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, (const char *)buf + done, size - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* Fill addr with the socket path, or return -1 if it is too long */
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Create a socket listening at path. A socket left there by an earlier
+ * server is replaced, but not any other kind of file. Return its file
+ * descriptor, or -1 (with errno set) on an error.
+ */
+int serve_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        if (unlink(path) == -1) {
+            return -1;
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Make reads and writes on fd fail with EAGAIN once they have waited
+ * seconds without any progress. Return 0, or -1 (with errno set).
+ */
+int serve_set_timeout(int fd, int seconds) {
+    struct timeval tv = {seconds, 0};
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Connect to the server at path. Return the socket, or -1 (with errno set). */
+int serve_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) == -1) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
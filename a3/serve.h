@@ -0,0 +1,38 @@
+#pragma once
+
+/* Protocol of the kNN server (knn_server.c) and its load generator
+ * (knn_client.c), over a UNIX domain stream socket.
+ *
+ * On one connection the client sends any number of requests, each
+ *     -   4 bytes : `n`: Number of images (1 to SERVE_MAX_BATCH)
+ *     - 784 bytes : Image 1 pixels
+ *     ...
+ *     - 784 bytes : Image n pixels
+ * and the server answers each one, in order, with
+ *     -   4 bytes : `n`
+ *     -   1 byte  : Image 1 predicted label
+ *     ...
+ *     -   1 byte  : Image n predicted label
+ * The counts are in the host's byte order (both ends are on one machine).
+ * The server closes the connection when the client does, when a request
+ * is malformed, or when the client has sent nothing (or not read the
+ * answer) for SERVE_IDLE_TIMEOUT seconds.
+ *
+ * Each server worker serves one connection at a time, for as long as it
+ * stays open, so there can be as many busy connections as workers and
+ * others wait to be accepted. The idle timeout keeps clients that hold
+ * a connection open without using it from tying up the workers.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SERVE_MAX_BATCH 4096
+#define SERVE_IDLE_TIMEOUT 5
+
+
+int read_full(int fd, void *buf, size_t size);
+int write_full(int fd, const void *buf, size_t size);
+int serve_listen(const char *path);
+int serve_set_timeout(int fd, int seconds);
+int serve_connect(const char *path);
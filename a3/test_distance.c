@@ -3,14 +3,20 @@
 #include <unistd.h> 
 #include <string.h>
 #include "knn.h"
+#include "ssd.h"
 
 /* A simple program to test the cosine distance function
  * On teach.cs, the following call produces the results below
  * ./test_distance /u/csc209h/winter/pub/datasets/a2_datasets/testing_data.bin
  * Cosine distance = 0.900966
  * Euclidean distance = 3205.300298
+ *
+ * It then checks that every ssd_u8() implementation the CPU supports
+ * agrees with the plain sum of squares for each pair of adjacent images.
  */
 
+static const char *ssd_kernels[] = {"scalar", "sse4", "avx2"};
+
 int main(int argc, char **argv) {
     if(argc != 2) {
         fprintf(stderr, "Usage: %s filename\n", argv[0]);
@@ -26,5 +32,28 @@ int main(int argc, char **argv) {
 
     printf("Cosine distance = %f\n", cos_distance);
     printf("Euclidean distance = %f\n", euc_distance);
+
+    const char *best = ssd_kernel();
+    for (int k = 0; k < sizeof(ssd_kernels) / sizeof(ssd_kernels[0]); k++) {
+        if (ssd_select(ssd_kernels[k]) == -1) {
+            printf("ssd %s: not supported\n", ssd_kernels[k]);
+            continue;
+        }
+        for (int i = 0; i + 1 < data->num_items; i++) {
+            unsigned char *a = data->images[i].data;
+            unsigned char *b = data->images[i + 1].data;
+            unsigned int expected = 0;
+            for (int j = 0; j < NUM_PIXELS; j++) {
+                expected += (a[j] - b[j]) * (a[j] - b[j]);
+            }
+            if (ssd_u8(a, b, NUM_PIXELS) != expected) {
+                printf("ssd %s: wrong result for images %d and %d\n", ssd_kernels[k], i, i + 1);
+                return 1;
+            }
+        }
+        printf("ssd %s: ok\n", ssd_kernels[k]);
+    }
+    ssd_select(best);
+    free_dataset(data);
     return 0;
 }